@@ -0,0 +1,574 @@
+// End-to-end latency of the hook: synthetic keyboards created through uinput
+// are hooked by a Reader daemon, and the events the writer injects into their
+// virtual keyboards are read back and matched against the ones sent.
+//
+// Requires root, the writer module loaded, and the keyboard-hook service
+// stopped (the daemon started here hooks every keyboard).
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <linux/input.h>
+#include <linux/uinput.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <boost/program_options.hpp>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+// Keys the benchmark types, none of them is remapped by the default keymap
+unsigned const benchmarkKeys[] = {
+  KEY_Q, KEY_W, KEY_E, KEY_R, KEY_T, KEY_Y, KEY_U, KEY_I, KEY_O, KEY_P, KEY_A, KEY_S,
+  KEY_D, KEY_F, KEY_G, KEY_H, KEY_J, KEY_K, KEY_L, KEY_Z, KEY_X, KEY_C, KEY_V, KEY_B,
+  KEY_N, KEY_M,
+};
+
+std::size_t const benchmarkKeyCount = sizeof(benchmarkKeys) / sizeof(benchmarkKeys[0]);
+
+// Time the hook has to deliver the last events of a phase
+std::int64_t const drainTimeout = 1000000000;
+
+std::int64_t now() {
+  struct timespec time;
+
+  clock_gettime(CLOCK_MONOTONIC, &time);
+
+  return (std::int64_t)time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+std::int64_t toNanoseconds(struct timeval const& time) {
+  return (std::int64_t)time.tv_sec * 1000000000 + (std::int64_t)time.tv_usec * 1000;
+}
+
+std::string deviceName(int fileDescriptor) {
+  char name[256] = {};
+
+  if (ioctl(fileDescriptor, EVIOCGNAME(sizeof(name) - 1), name) < 0) {
+    return std::string();
+  }
+
+  return name;
+}
+
+// Number N of the /dev/input/eventN node of the device, -1 if there is none
+int findDevice(std::string const& name) {
+  DIR* directory = opendir("/dev/input");
+  int result = -1;
+
+  if (directory == NULL) {
+    return -1;
+  }
+
+  while (struct dirent* entry = readdir(directory)) {
+    unsigned number;
+    char end;
+
+    if (sscanf(entry->d_name, "event%u%c", &number, &end) != 1) {
+      continue;
+    }
+
+    int fileDescriptor = open(("/dev/input/" + std::string(entry->d_name)).c_str(),
+                              O_RDONLY | O_CLOEXEC);
+
+    if (fileDescriptor < 0) {
+      continue;
+    }
+
+    bool isFound = deviceName(fileDescriptor) == name;
+
+    close(fileDescriptor);
+
+    if (isFound) {
+      result = (int)number;
+
+      break;
+    }
+  }
+
+  closedir(directory);
+
+  return result;
+}
+
+struct Sent {
+  unsigned code;
+  std::int64_t time;
+};
+
+// A synthetic source keyboard and the virtual keyboard the hook injects its
+// events into
+class BenchmarkDevice {
+public:
+  explicit BenchmarkDevice(unsigned index)
+    : _name("Keyboard Hook benchmark keyboard " + std::to_string(index)),
+      _sourceFileDescriptor(-1),
+      _outputFileDescriptor(-1),
+      _keyIndex(0),
+      _isPressed(false),
+      _lostCount(0) {}
+
+  BenchmarkDevice(BenchmarkDevice const&) = delete;
+
+  ~BenchmarkDevice() {
+    if (_outputFileDescriptor >= 0) {
+      close(_outputFileDescriptor);
+    }
+
+    if (_sourceFileDescriptor >= 0) {
+      ioctl(_sourceFileDescriptor, UI_DEV_DESTROY);
+      close(_sourceFileDescriptor);
+    }
+  }
+
+  BenchmarkDevice& operator=(BenchmarkDevice const&) = delete;
+
+  bool create() {
+    _sourceFileDescriptor = open("/dev/uinput", O_WRONLY | O_CLOEXEC);
+
+    if (_sourceFileDescriptor < 0) {
+      fprintf(stderr, "Failed to open /dev/uinput: %s\n", strerror(errno));
+
+      return false;
+    }
+
+    ioctl(_sourceFileDescriptor, UI_SET_EVBIT, EV_KEY);
+    ioctl(_sourceFileDescriptor, UI_SET_EVBIT, EV_MSC);
+    ioctl(_sourceFileDescriptor, UI_SET_MSCBIT, MSC_SCAN);
+
+    for (unsigned code : benchmarkKeys) {
+      ioctl(_sourceFileDescriptor, UI_SET_KEYBIT, code);
+    }
+
+    struct uinput_setup setup = {};
+
+    setup.id.bustype = BUS_VIRTUAL;
+    setup.id.vendor = 0x4b48;
+    setup.id.product = 0x0001;
+    strncpy(setup.name, _name.c_str(), UINPUT_MAX_NAME_SIZE - 1);
+
+    if (ioctl(_sourceFileDescriptor, UI_DEV_SETUP, &setup) != 0
+        || ioctl(_sourceFileDescriptor, UI_DEV_CREATE) != 0) {
+      fprintf(stderr, "Failed to create %s: %s\n", _name.c_str(), strerror(errno));
+
+      return false;
+    }
+
+    return true;
+  }
+
+  // Opens the virtual keyboard once the hook created it, with the events
+  // stamped by the clock the send times are taken with
+  bool openOutput(std::int64_t deadline) {
+    int sourceNumber = -1;
+
+    while (sourceNumber < 0 && now() < deadline) {
+      sourceNumber = findDevice(_name);
+
+      if (sourceNumber < 0) {
+        usleep(10000);
+      }
+    }
+
+    std::string outputName = _name + " KH" + std::to_string(sourceNumber);
+    int outputNumber = -1;
+
+    while (sourceNumber >= 0 && outputNumber < 0 && now() < deadline) {
+      outputNumber = findDevice(outputName);
+
+      if (outputNumber < 0) {
+        usleep(10000);
+      }
+    }
+
+    if (outputNumber < 0) {
+      fprintf(stderr, "The hook did not create %s\n", outputName.c_str());
+
+      return false;
+    }
+
+    std::string path = "/dev/input/event" + std::to_string(outputNumber);
+    int clock = CLOCK_MONOTONIC;
+
+    _outputFileDescriptor = open(path.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+
+    if (_outputFileDescriptor < 0
+        || ioctl(_outputFileDescriptor, EVIOCSCLOCKID, &clock) != 0) {
+      fprintf(stderr, "Failed to open %s: %s\n", path.c_str(), strerror(errno));
+
+      return false;
+    }
+
+    return true;
+  }
+
+  // The daemon grabs the keyboard between frames, so a frame is sent until
+  // one comes back through the hook
+  bool waitUntilHooked(std::int64_t deadline) {
+    while (now() < deadline) {
+      if (!send()) {
+        return false;
+      }
+
+      receive(now() + 20000000);
+
+      if (!_latencies.empty()) {
+        reset();
+
+        return true;
+      }
+    }
+
+    fprintf(stderr, "No events of %s came through the hook\n", _name.c_str());
+
+    return false;
+  }
+
+  // Sends key events at the rate, the latency of each is recorded
+  bool runPaced(std::size_t count, double rate) {
+    std::int64_t period = (std::int64_t)(1e9 / rate);
+    std::int64_t next = now();
+
+    for (std::size_t i = 0; i < count; ++i) {
+      while (now() < next) {
+        receive(next);
+      }
+
+      if (!send()) {
+        return false;
+      }
+
+      next += period;
+    }
+
+    drain();
+
+    return true;
+  }
+
+  // Sends key events as fast as they are delivered, with at most window of
+  // them in flight so that none is lost to the evdev buffers
+  bool runFlood(std::size_t count, std::size_t window) {
+    std::size_t sent = 0;
+
+    while (sent < count) {
+      if (_pending.size() < window) {
+        if (!send()) {
+          return false;
+        }
+
+        ++sent;
+
+        receive(0);
+      } else if (!receive(now() + drainTimeout)) {
+        fprintf(stderr, "The hook stopped delivering the events of %s\n", _name.c_str());
+
+        return false;
+      }
+    }
+
+    drain();
+
+    return true;
+  }
+
+  void reset() {
+    _latencies.clear();
+    _lostCount = 0;
+  }
+
+  std::vector<std::int64_t> const& latencies() const { return _latencies; }
+
+  std::size_t lostCount() const { return _lostCount + _pending.size(); }
+
+private:
+  bool writeEvent(__u16 type, __u16 code, __s32 value) {
+    struct input_event event = {};
+
+    event.type = type;
+    event.code = code;
+    event.value = value;
+
+    return write(_sourceFileDescriptor, &event, sizeof(event)) == sizeof(event);
+  }
+
+  // Presses and releases the keys in turn, a key event in a frame of its own
+  bool send() {
+    unsigned code = benchmarkKeys[_keyIndex];
+
+    _isPressed = !_isPressed;
+
+    if (!_isPressed) {
+      _keyIndex = (_keyIndex + 1) % benchmarkKeyCount;
+    }
+
+    _pending.push_back(Sent{code, now()});
+
+    if (!writeEvent(EV_MSC, MSC_SCAN, code) || !writeEvent(EV_KEY, code, _isPressed)
+        || !writeEvent(EV_SYN, SYN_REPORT, 0)) {
+      fprintf(stderr, "Failed to send to %s: %s\n", _name.c_str(), strerror(errno));
+
+      return false;
+    }
+
+    return true;
+  }
+
+  // Reads the events delivered until the deadline, returns false if there
+  // were none
+  bool receive(std::int64_t deadline) {
+    struct input_event events[64];
+    bool isReceived = false;
+
+    while (true) {
+      ssize_t size = read(_outputFileDescriptor, events, sizeof(events));
+
+      if (size > 0) {
+        for (ssize_t i = 0; i < size / (ssize_t)sizeof(events[0]); ++i) {
+          match(events[i]);
+        }
+
+        isReceived = true;
+
+        continue;
+      }
+
+      std::int64_t timeout = deadline - now();
+
+      if (isReceived || timeout <= 0) {
+        return isReceived;
+      }
+
+      struct pollfd descriptor = {_outputFileDescriptor, POLLIN, 0};
+
+      poll(&descriptor, 1, (int)std::max<std::int64_t>(timeout / 1000000, 1));
+    }
+  }
+
+  void drain() {
+    std::int64_t deadline = now() + drainTimeout;
+
+    while (!_pending.empty() && receive(deadline)) {
+    }
+  }
+
+  void match(struct input_event const& event) {
+    if (event.type != EV_KEY || event.value == 2) {
+      return;
+    }
+
+    // Events overtaken by one delivered later are lost
+    while (!_pending.empty() && _pending.front().code != event.code) {
+      _pending.pop_front();
+      ++_lostCount;
+    }
+
+    if (_pending.empty()) {
+      return;
+    }
+
+    _latencies.push_back(toNanoseconds(event.time) - _pending.front().time);
+    _pending.pop_front();
+  }
+
+  std::string _name;
+  int _sourceFileDescriptor;
+  int _outputFileDescriptor;
+  std::size_t _keyIndex;
+  bool _isPressed;
+  std::size_t _lostCount;
+  std::deque<Sent> _pending;
+  std::vector<std::int64_t> _latencies;
+};
+
+pid_t startReader(std::string const& reader, std::string const& config) {
+  pid_t pid = fork();
+
+  if (pid == 0) {
+    execlp(reader.c_str(), reader.c_str(), "--daemon", "--config", config.c_str(), NULL);
+    fprintf(stderr, "Failed to run %s: %s\n", reader.c_str(), strerror(errno));
+    _exit(127);
+  }
+
+  return pid;
+}
+
+void stopReader(pid_t pid) {
+  if (pid > 0) {
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+  }
+}
+
+double percentile(std::vector<std::int64_t> const& sorted, double fraction) {
+  if (sorted.empty()) {
+    return 0;
+  }
+
+  std::size_t index = std::min(sorted.size() - 1, (std::size_t)(sorted.size() * fraction));
+
+  return sorted[index] / 1e3;
+}
+
+// Runs the phase on every device at once, returns false if any failed
+template <typename Phase>
+bool runPhase(std::vector<std::unique_ptr<BenchmarkDevice>>& devices, Phase phase) {
+  std::vector<std::thread> threads;
+  std::vector<char> results(devices.size(), 0);
+
+  for (std::size_t i = 0; i < devices.size(); ++i) {
+    devices[i]->reset();
+
+    threads.emplace_back([&, i]() { results[i] = phase(*devices[i]); });
+  }
+
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  return std::all_of(results.begin(), results.end(), [](char result) { return result; });
+}
+
+std::vector<std::int64_t>
+collectLatencies(std::vector<std::unique_ptr<BenchmarkDevice>> const& devices,
+                 std::size_t* lostCount) {
+  std::vector<std::int64_t> latencies;
+
+  *lostCount = 0;
+
+  for (auto const& device : devices) {
+    latencies.insert(
+      latencies.end(), device->latencies().begin(), device->latencies().end());
+    *lostCount += device->lostCount();
+  }
+
+  std::sort(latencies.begin(), latencies.end());
+
+  return latencies;
+}
+} // namespace
+
+int main(int argc, char* argv[]) {
+  namespace po = boost::program_options;
+  po::options_description desc("Allowed options");
+  desc.add_options()("help,h", "Displays help")(
+    "reader,r",
+    po::value<std::string>()->default_value("KeyboardHookReader"),
+    "Reader executable to benchmark")(
+    "config,c",
+    po::value<std::string>()->default_value("/nonexistent/keyboard-hook.conf"),
+    "keymap configuration of the Reader, the default keymap if it does not exist")(
+    "devices,n", po::value<unsigned>()->default_value(1), "number of source keyboards")(
+    "rate", po::value<double>()->default_value(1000), "key events per second per keyboard")(
+    "events", po::value<std::size_t>()->default_value(20000), "paced key events per keyboard")(
+    "flood-events",
+    po::value<std::size_t>()->default_value(200000),
+    "key events per keyboard sent as fast as they are delivered")(
+    "window", po::value<std::size_t>()->default_value(64), "key events in flight while flooding");
+
+  po::variables_map vm;
+  po::store(po::parse_command_line(argc, argv, desc), vm);
+  po::notify(vm);
+
+  if (vm.count("help")) {
+    std::cout << "Measures the latency the hook adds, requires root and the writer module"
+              << std::endl;
+    std::cout << desc << std::endl;
+    return 0;
+  }
+
+  unsigned const deviceCount = vm["devices"].as<unsigned>();
+  double const rate = vm["rate"].as<double>();
+  std::size_t const eventCount = vm["events"].as<std::size_t>();
+  std::size_t const floodEventCount = vm["flood-events"].as<std::size_t>();
+  std::size_t const window = std::max<std::size_t>(vm["window"].as<std::size_t>(), 1);
+
+  if (deviceCount == 0 || rate <= 0) {
+    std::cerr << desc << std::endl;
+    return 1;
+  }
+
+  std::vector<std::unique_ptr<BenchmarkDevice>> devices;
+
+  for (unsigned i = 0; i < deviceCount; ++i) {
+    devices.emplace_back(new BenchmarkDevice(i));
+
+    if (!devices.back()->create()) {
+      return 1;
+    }
+  }
+
+  pid_t reader
+    = startReader(vm["reader"].as<std::string>(), vm["config"].as<std::string>());
+  std::int64_t deadline = now() + 10 * drainTimeout;
+  bool isReady = reader > 0;
+
+  for (auto& device : devices) {
+    isReady = isReady && device->openOutput(deadline) && device->waitUntilHooked(deadline);
+  }
+
+  if (!isReady) {
+    stopReader(reader);
+    return 1;
+  }
+
+  std::size_t lostCount = 0;
+
+  if (!runPhase(devices, [&](BenchmarkDevice& device) {
+        return device.runPaced(eventCount, rate);
+      })) {
+    stopReader(reader);
+    return 1;
+  }
+
+  std::vector<std::int64_t> latencies = collectLatencies(devices, &lostCount);
+
+  printf("Latency at %.0f events/s on %u keyboards (%zu events, %zu lost)\n",
+         rate,
+         deviceCount,
+         latencies.size(),
+         lostCount);
+  printf("  p50   %9.1f us\n", percentile(latencies, 0.5));
+  printf("  p99   %9.1f us\n", percentile(latencies, 0.99));
+  printf("  p99.9 %9.1f us\n", percentile(latencies, 0.999));
+  printf("  max   %9.1f us\n", latencies.empty() ? 0 : latencies.back() / 1e3);
+
+  std::int64_t start = now();
+
+  if (!runPhase(devices, [&](BenchmarkDevice& device) {
+        return device.runFlood(floodEventCount, window);
+      })) {
+    stopReader(reader);
+    return 1;
+  }
+
+  double elapsed = (now() - start) / 1e9;
+
+  latencies = collectLatencies(devices, &lostCount);
+
+  printf("Sustained %.0f events/s on %u keyboards (%zu events, %zu lost, p99 %.1f us)\n",
+         latencies.size() / elapsed,
+         deviceCount,
+         latencies.size(),
+         lostCount,
+         percentile(latencies, 0.99));
+
+  stopReader(reader);
+
+  return 0;
+}
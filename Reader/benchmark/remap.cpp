@@ -0,0 +1,231 @@
+// Throughput of the remapping alone: synthetic events are pushed through
+// forwardEvent() the way Device does, without any device.
+
+#include <linux/input.h>
+
+#include <boost/program_options.hpp>
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "EventHandler.hpp"
+#include "FrameBuffer.hpp"
+#include "KeymapConfig.hpp"
+#include "allocation.hpp"
+
+namespace {
+using namespace KeyboardHook::Reader;
+
+typedef std::vector<struct input_event> Events;
+
+// The default keymap along with the ";" rewrite and a chord
+char const* const benchmarkConfig = "[keyboard]\n"
+                                    "CAPSLOCK = ESC\n"
+                                    "102ND = LEFTSHIFT\n"
+                                    "COMPOSE = LEFTMETA\n"
+                                    "SYSRQ = LEFTMETA\n"
+                                    "SEMICOLON = semicolon\n"
+                                    "F13 = LEFTCTRL+C\n";
+
+unsigned const typedKeys[] = {
+  KEY_Q, KEY_W, KEY_E, KEY_R, KEY_T, KEY_Y, KEY_U, KEY_I, KEY_O, KEY_P, KEY_A, KEY_S,
+  KEY_D, KEY_F, KEY_G, KEY_H, KEY_J, KEY_K, KEY_L, KEY_Z, KEY_X, KEY_C, KEY_V, KEY_B,
+  KEY_N, KEY_M, KEY_SPACE, KEY_DOT, KEY_COMMA, KEY_ENTER,
+};
+
+void appendEvent(Events* events, __u16 type, __u16 code, __s32 value) {
+  struct input_event event = {};
+
+  event.type = type;
+  event.code = code;
+  event.value = value;
+
+  events->push_back(event);
+}
+
+// A key event in a frame of its own, as keyboards report them
+void appendKey(Events* events, unsigned code, __s32 value) {
+  appendEvent(events, EV_MSC, MSC_SCAN, code);
+  appendEvent(events, EV_KEY, code, value);
+  appendEvent(events, EV_SYN, SYN_REPORT, 0);
+}
+
+void appendTap(Events* events, unsigned code) {
+  appendKey(events, code, 1);
+  appendKey(events, code, 0);
+}
+
+Events typing() {
+  Events events;
+
+  for (unsigned code : typedKeys) {
+    appendTap(&events, code);
+  }
+
+  return events;
+}
+
+// Shortcuts held with one or two modifiers, and a chord key
+Events chords() {
+  Events events;
+
+  for (unsigned code : typedKeys) {
+    appendKey(&events, KEY_LEFTCTRL, 1);
+    appendTap(&events, code);
+    appendKey(&events, KEY_LEFTSHIFT, 1);
+    appendTap(&events, code);
+    appendKey(&events, KEY_LEFTSHIFT, 0);
+    appendKey(&events, KEY_LEFTCTRL, 0);
+    appendTap(&events, KEY_F13);
+  }
+
+  return events;
+}
+
+// Alt-; rewritten to ";", along with plain and shifted ";"
+Events altSemicolon() {
+  Events events;
+
+  for (unsigned code : typedKeys) {
+    appendKey(&events, KEY_LEFTALT, 1);
+    appendTap(&events, KEY_SEMICOLON);
+    appendTap(&events, KEY_SEMICOLON);
+    appendKey(&events, KEY_LEFTALT, 0);
+    appendTap(&events, KEY_SEMICOLON);
+    appendKey(&events, KEY_LEFTSHIFT, 1);
+    appendTap(&events, KEY_SEMICOLON);
+    appendKey(&events, KEY_LEFTSHIFT, 0);
+    appendTap(&events, code);
+  }
+
+  return events;
+}
+
+// Keys held long enough to repeat, ";" included
+Events autorepeat() {
+  Events events;
+
+  for (unsigned code : {KEY_J, KEY_SEMICOLON, KEY_BACKSPACE, KEY_DOWN}) {
+    appendKey(&events, code, 1);
+
+    for (int i = 0; i < 30; ++i) {
+      appendKey(&events, code, 2);
+    }
+
+    appendKey(&events, code, 0);
+  }
+
+  return events;
+}
+
+struct Result {
+  double nanosecondsPerEvent;
+  double allocationsPerEvent;
+  std::uint64_t sentCount;
+};
+
+// Runs the events through the handler until count of them are handled,
+// frames are dropped where Device writes them
+Result run(Events const& workload,
+           std::shared_ptr<Keymap const> const& keymap,
+           std::uint64_t count) {
+  EventHandler handler;
+  FrameBuffer frame;
+  std::uint64_t sentCount = 0;
+
+  handler.setKeymap(keymap);
+
+  auto flush = [&frame, &sentCount]() {
+    sentCount += frame.size();
+    frame.clear();
+
+    return 0;
+  };
+
+  AllocationCounter counter;
+  auto start = std::chrono::steady_clock::now();
+
+  for (std::uint64_t handled = 0; handled < count;) {
+    for (struct input_event const& input : workload) {
+      struct input_event event = input;
+
+      forwardEvent(&handler, &frame, &event, flush);
+    }
+
+    handled += workload.size();
+  }
+
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  std::uint64_t handledCount = (count + workload.size() - 1) / workload.size() * workload.size();
+
+  Result result;
+  result.nanosecondsPerEvent
+    = std::chrono::duration<double, std::nano>(elapsed).count() / handledCount;
+  result.allocationsPerEvent = double(counter.count()) / handledCount;
+  result.sentCount = sentCount;
+
+  return result;
+}
+} // namespace
+
+int main(int argc, char* argv[]) {
+  namespace po = boost::program_options;
+  po::options_description desc("Allowed options");
+  desc.add_options()("help,h", "Displays help")(
+    "events,e",
+    po::value<std::uint64_t>()->default_value(10000000),
+    "events handled per workload");
+
+  po::variables_map vm;
+  po::store(po::parse_command_line(argc, argv, desc), vm);
+  po::notify(vm);
+
+  if (vm.count("help")) {
+    std::cout << "Measures the remapping of synthetic events" << std::endl;
+    std::cout << desc << std::endl;
+    return 0;
+  }
+
+  std::uint64_t const count = vm["events"].as<std::uint64_t>();
+  KeymapConfig config;
+  std::istringstream input(benchmarkConfig);
+
+  if (!config.parse(input, "benchmark keymap")) {
+    return 1;
+  }
+
+  std::shared_ptr<Keymap const> keymap = config.compile(DeviceIdentity{"", 0, 0, 0});
+
+  struct Workload {
+    char const* name;
+    Events events;
+  };
+
+  std::vector<Workload> const workloads = {
+    {"typing", typing()},
+    {"chords", chords()},
+    {"alt-semicolon", altSemicolon()},
+    {"autorepeat", autorepeat()},
+  };
+
+  printf("%-16s %10s %18s %12s\n", "workload", "ns/event", "allocations/event", "sent/event");
+
+  for (Workload const& workload : workloads) {
+    Result result = run(workload.events, keymap, count);
+
+    printf("%-16s %10.2f %18.4f %12.2f\n",
+           workload.name,
+           result.nanosecondsPerEvent,
+           result.allocationsPerEvent,
+           double(result.sentCount)
+             / ((count + workload.events.size() - 1) / workload.events.size()
+                * workload.events.size()));
+  }
+
+  return 0;
+}
@@ -0,0 +1,1075 @@
+#include "Daemon.hpp"
+
+#include <fcntl.h>
+#include <libgen.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <signal.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdint>
+#include <type_traits>
+
+#include "handoff.hpp"
+#include "log.hpp"
+#include "realtime.hpp"
+
+#define KEYBOARD_HOOK_READER_INPUT_DIRECTORY "/dev/input"
+
+namespace KeyboardHook {
+namespace Reader {
+static int const maxEpollEvents = 16;
+
+// How long a daemon handing its devices over waits for the other one to take
+// them, it keeps forwarding if it does not
+static int const handoffTimeoutSeconds = 5;
+
+// A poll shorter than this is not worth starting
+static std::int64_t const minSpinWindow = 1000;
+
+static std::int64_t monotonicNow() {
+  struct timespec time;
+
+  clock_gettime(CLOCK_MONOTONIC, &time);
+
+  return (std::int64_t)time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+#ifdef KEYBOARD_HOOK_READER_IO_URING
+// Submissions queued within a wakeup, a read and a doorbell for each device
+static unsigned const ringEntryCount = 64;
+
+// Reads completed and not forwarded yet, of all the devices together
+static unsigned const ringBufferCount = 64;
+
+enum RingOperation : std::uint64_t { ringRead, ringWrite, ringControl };
+
+// Completions carry the number of the device, its generation and the operation
+static std::uint64_t
+ringData(unsigned number, std::uint32_t generation, RingOperation operation) {
+  return (std::uint64_t)generation << 32 | (std::uint64_t)number << 2 | operation;
+}
+
+static char const doorbell = 0;
+#endif
+
+static_assert(std::is_trivially_copyable<DeviceHandoff>::value,
+              "Devices are handed over as they are in memory");
+
+bool isHookDevice(std::string const& name) {
+  std::size_t position = name.rfind(" KH");
+
+  if (position == std::string::npos || position + 3 == name.size()) {
+    return false;
+  }
+
+  return std::all_of(name.begin() + position + 3, name.end(), [](char c) {
+    return std::isdigit((unsigned char)c);
+  });
+}
+
+bool isKeyboard(std::string const& name) {
+  std::string lowerName(name);
+
+  std::transform(lowerName.begin(), lowerName.end(), lowerName.begin(), [](char c) {
+    return std::tolower((unsigned char)c);
+  });
+
+  return lowerName.find("keyboard") != std::string::npos && !isHookDevice(name);
+}
+
+Daemon::Daemon(std::string const& configPath)
+  : _epollFileDescriptor(epoll_create1(EPOLL_CLOEXEC)),
+    _inotifyFileDescriptor(-1),
+    _devicesWatch(-1),
+    _configWatch(-1),
+    _reloadFileDescriptor(-1),
+    _handoffFileDescriptor(-1),
+    _signalFileDescriptor(-1),
+    _configPath(configPath),
+    _isReloadRequested(false),
+    _reload(nullptr),
+    _spinWindow(0),
+    _maxSpinWindow(0) {
+  if (_epollFileDescriptor < 0) {
+    logError("Failed to create epoll instance: %s", strerror(errno));
+  }
+
+#ifdef KEYBOARD_HOOK_READER_IO_URING
+  _ringGeneration = 0;
+  _isControlReady = true;
+
+  // Without it the devices are watched through epoll
+  std::size_t const bufferSize = Device::readCapacity * sizeof(struct input_event);
+
+  if (_ring.create(ringEntryCount, ringBufferCount, bufferSize)) {
+    logInfo("Forwarding through io_uring");
+  }
+#endif
+}
+
+bool Daemon::loadConfig() {
+  if (access(_configPath.c_str(), F_OK) != 0) {
+    logInfo("No %s, using the default keymap", _configPath.c_str());
+
+    return true;
+  }
+
+  return _config.load(_configPath);
+}
+
+Daemon::~Daemon() {
+  _devices.clear();
+
+  if (_reloadThread.joinable()) {
+    _reloadThread.join();
+  }
+
+  delete _reload.exchange(nullptr);
+
+  if (_signalFileDescriptor >= 0) {
+    close(_signalFileDescriptor);
+  }
+
+  // The socket is left for the daemon that took over
+  if (_handoffFileDescriptor >= 0) {
+    close(_handoffFileDescriptor);
+  }
+
+  if (_reloadFileDescriptor >= 0) {
+    close(_reloadFileDescriptor);
+  }
+
+  if (_inotifyFileDescriptor >= 0) {
+    close(_inotifyFileDescriptor);
+  }
+
+  if (_epollFileDescriptor >= 0) {
+    close(_epollFileDescriptor);
+  }
+}
+
+void Daemon::addKeyboards() {
+  for (unsigned number : findDevices()) {
+    addKeyboard(number);
+  }
+}
+
+void Daemon::addKeyboard(unsigned number) {
+  if (_devices.count(number) != 0) {
+    return;
+  }
+
+  Device device(number);
+
+  if (device.open() && isKeyboard(device.name())) {
+    addDevice(number);
+  }
+}
+
+bool Daemon::addDevice(unsigned number) {
+  if (_epollFileDescriptor < 0 || _devices.count(number) != 0) {
+    return false;
+  }
+
+  std::unique_ptr<Device> device(new Device(number));
+
+  if (!device->open()) {
+    return false;
+  }
+
+  device->setKeymap(_config.compile(device->identity()));
+
+  if (!device->attach()) {
+    return false;
+  }
+
+  return startDevice(std::move(device));
+}
+
+bool Daemon::startDevice(std::unique_ptr<Device> device) {
+  if (!watchDevice(device.get())) {
+    return false;
+  }
+
+  // Events queued before the device was watched do not wake the loop
+  if (!device->forward()) {
+    removeDevice(device.get());
+
+    return false;
+  }
+
+  unsigned number = device->number();
+
+  _metrics.add(number, device->path(), device->name(), device->metrics());
+  _devices[number] = std::move(device);
+
+  return true;
+}
+
+bool Daemon::takeOver(bool isRequired) {
+  if (_epollFileDescriptor < 0) {
+    return false;
+  }
+
+  int connection = connectForHandoff(isRequired);
+
+  if (connection < 0) {
+    return !isRequired;
+  }
+
+  struct ucred credentials = {};
+  socklen_t size = sizeof(credentials);
+
+  getsockopt(connection, SOL_SOCKET, SO_PEERCRED, &credentials, &size);
+
+  HandoffHeader header;
+  std::vector<std::unique_ptr<Device>> devices;
+  bool isValid = receiveMessage(connection, &header, sizeof(header), NULL, 0)
+                 && header.magic == handoffMagic && header.version == handoffVersion
+                 && header.deviceSize == sizeof(DeviceHandoff);
+
+  for (std::uint32_t i = 0; isValid && i < header.deviceCount; ++i) {
+    DeviceHandoff handoff;
+    int fileDescriptors[2];
+
+    isValid = receiveMessage(connection, &handoff, sizeof(handoff), fileDescriptors, 2);
+
+    if (!isValid) {
+      break;
+    }
+
+    std::unique_ptr<Device> device(new Device(handoff.number));
+
+    // The device owns the descriptors from here on, it fails closing them
+    isValid = device->takeOver(handoff, fileDescriptors[0], fileDescriptors[1]);
+
+    if (isValid) {
+      device->setKeymap(_config.compile(device->identity()));
+      devices.push_back(std::move(device));
+    }
+  }
+
+  char const confirmation = 1;
+
+  // The service follows the daemon that forwards, before the running one
+  // exits on the confirmation
+  if (isValid) {
+    notifyService(("MAINPID=" + std::to_string(getpid())).c_str());
+  }
+
+  // The running daemon keeps forwarding until it is confirmed, so nothing is
+  // read here before
+  if (!isValid || send(connection, &confirmation, 1, MSG_NOSIGNAL) != 1) {
+    logError("Failed to take the devices over");
+
+    if (isValid && credentials.pid > 0) {
+      notifyService(("MAINPID=" + std::to_string(credentials.pid)).c_str());
+    }
+
+    close(connection);
+
+    return false;
+  }
+
+  close(connection);
+
+  logInfo("Took over %zu devices", devices.size());
+
+  for (auto& device : devices) {
+    startDevice(std::move(device));
+  }
+
+  return true;
+}
+
+bool Daemon::listenForHandoff() {
+  if (_epollFileDescriptor < 0) {
+    return false;
+  }
+
+  _handoffFileDescriptor = KeyboardHook::Reader::listenForHandoff();
+
+  if (_handoffFileDescriptor < 0) {
+    return false;
+  }
+
+  return watch(_handoffFileDescriptor, &_handoffFileDescriptor);
+}
+
+bool Daemon::handOver() {
+  int connection = accept4(_handoffFileDescriptor, NULL, NULL, SOCK_CLOEXEC);
+
+  if (connection < 0) {
+    return false;
+  }
+
+  struct ucred credentials;
+  socklen_t size = sizeof(credentials);
+
+  if (getsockopt(connection, SOL_SOCKET, SO_PEERCRED, &credentials, &size) != 0
+      || credentials.uid != geteuid()) {
+    logError("Refusing to hand the devices over to another user");
+
+    close(connection);
+
+    return false;
+  }
+
+  struct timeval timeout = {handoffTimeoutSeconds, 0};
+
+  setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(connection, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+  // The socket is gone before the other daemon can create its own, the
+  // listening one is recreated if the handoff fails
+  epoll_ctl(_epollFileDescriptor, EPOLL_CTL_DEL, _handoffFileDescriptor, NULL);
+  close(_handoffFileDescriptor);
+  _handoffFileDescriptor = -1;
+  unlink(KEYBOARD_HOOK_READER_HANDOFF_SOCKET);
+
+#ifdef KEYBOARD_HOOK_READER_IO_URING
+  if (_ring.isCreated()) {
+    stopReading();
+  }
+#endif
+
+  HandoffHeader header
+    = {handoffMagic, handoffVersion, (std::uint32_t)_devices.size(), sizeof(DeviceHandoff)};
+  bool isSent = sendMessage(connection, &header, sizeof(header), NULL, 0);
+
+  for (auto& device : _devices) {
+    if (!isSent) {
+      break;
+    }
+
+    DeviceHandoff handoff = device.second->handOver();
+    int fileDescriptors[]
+      = {device.second->fileDescriptor(), device.second->outputFileDescriptor()};
+
+    isSent = sendMessage(connection, &handoff, sizeof(handoff), fileDescriptors, 2);
+  }
+
+  char confirmation = 0;
+  bool isConfirmed = isSent && recv(connection, &confirmation, 1, 0) == 1;
+
+  close(connection);
+
+  if (!isConfirmed) {
+    logError("The devices were not taken over, forwarding on");
+
+#ifdef KEYBOARD_HOOK_READER_IO_URING
+    if (_ring.isCreated()) {
+      resumeReading();
+    }
+#endif
+
+    listenForHandoff();
+
+    return false;
+  }
+
+  return true;
+}
+
+void Daemon::removeDevice(Device* device) {
+  logInfo("Detached %s", device->path().c_str());
+
+  unwatchDevice(device);
+
+  _metrics.remove(device->number());
+  _devices.erase(device->number());
+}
+
+bool Daemon::watch(int fileDescriptor, void* data) {
+  struct epoll_event event;
+  event.events = EPOLLIN;
+  event.data.ptr = data;
+
+  if (epoll_ctl(_epollFileDescriptor, EPOLL_CTL_ADD, fileDescriptor, &event) != 0) {
+    logError("Failed to watch descriptor %d: %s", fileDescriptor, strerror(errno));
+
+    return false;
+  }
+
+  return true;
+}
+
+bool Daemon::watchDevice(Device* device) {
+#ifdef KEYBOARD_HOOK_READER_IO_URING
+  if (_ring.isCreated()) {
+    return startReading(device);
+  }
+#endif
+
+  return watch(device->fileDescriptor(), device);
+}
+
+void Daemon::unwatchDevice(Device* device) {
+#ifdef KEYBOARD_HOOK_READER_IO_URING
+  if (_ring.isCreated()) {
+    // Completions still to come are told apart by the generation
+    _ring.cancel(device->fileDescriptor());
+    _ringDevices.erase(device->number());
+
+    return;
+  }
+#endif
+
+  epoll_ctl(_epollFileDescriptor, EPOLL_CTL_DEL, device->fileDescriptor(), NULL);
+}
+
+bool Daemon::createInotify() {
+  if (_inotifyFileDescriptor >= 0) {
+    return true;
+  }
+
+  _inotifyFileDescriptor = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+  if (_inotifyFileDescriptor < 0) {
+    logError("Failed to create inotify instance: %s", strerror(errno));
+
+    return false;
+  }
+
+  return watch(_inotifyFileDescriptor, &_inotifyFileDescriptor);
+}
+
+bool Daemon::watchDevices() {
+  if (!createInotify()) {
+    return false;
+  }
+
+  // The node is created before udev sets its permissions, a keyboard that
+  // cannot be opened yet on creation is retried on the attribute change.
+  // Removed devices hang up their own descriptors, so deletions are not watched.
+  _devicesWatch = inotify_add_watch(
+    _inotifyFileDescriptor, KEYBOARD_HOOK_READER_INPUT_DIRECTORY, IN_CREATE | IN_ATTRIB);
+
+  if (_devicesWatch < 0) {
+    logError("Failed to watch %s: %s",
+             KEYBOARD_HOOK_READER_INPUT_DIRECTORY,
+             strerror(errno));
+
+    return false;
+  }
+
+  return true;
+}
+
+bool Daemon::watchConfig() {
+  if (!createInotify()) {
+    return false;
+  }
+
+  _reloadFileDescriptor = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+  if (_reloadFileDescriptor < 0 || !watch(_reloadFileDescriptor, &_reloadFileDescriptor)) {
+    logError("Failed to create the reload event");
+
+    return false;
+  }
+
+  // Editors replace the file as often as they rewrite it, so its directory is
+  // watched
+  std::vector<char> path(_configPath.begin(), _configPath.end());
+  path.push_back('\0');
+  _configName = basename(path.data());
+
+  _configWatch = inotify_add_watch(
+    _inotifyFileDescriptor, dirname(path.data()), IN_CLOSE_WRITE | IN_MOVED_TO);
+
+  if (_configWatch < 0) {
+    logError("Failed to watch %s: %s", _configPath.c_str(), strerror(errno));
+
+    return false;
+  }
+
+  return true;
+}
+
+void Daemon::handleInotifyEvents() {
+  alignas(struct inotify_event) char buffer[4096];
+
+  while (true) {
+    ssize_t size = read(_inotifyFileDescriptor, buffer, sizeof(buffer));
+
+    if (size <= 0) {
+      return;
+    }
+
+    for (char* pointer = buffer; pointer < buffer + size;) {
+      struct inotify_event* event = (struct inotify_event*)pointer;
+      unsigned number;
+
+      pointer += sizeof(struct inotify_event) + event->len;
+
+      if (event->mask & IN_Q_OVERFLOW) {
+        if (_devicesWatch >= 0) {
+          addKeyboards();
+        }
+
+        if (_configWatch >= 0) {
+          startReload();
+        }
+      } else if (event->len == 0) {
+        continue;
+      } else if (event->wd == _configWatch) {
+        if (_configName == event->name) {
+          startReload();
+        }
+      } else if (event->wd == _devicesWatch && parseDeviceNumber(event->name, &number)) {
+        addKeyboard(number);
+      }
+    }
+  }
+}
+
+bool Daemon::serveMetrics() {
+  return _metrics.start(KEYBOARD_HOOK_READER_METRICS_SOCKET);
+}
+
+bool Daemon::watchSignals() {
+  if (_epollFileDescriptor < 0) {
+    return false;
+  }
+
+  sigset_t signals;
+
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGUSR1);
+
+  // Blocked before any thread is started, so that all of them inherit it
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+  _signalFileDescriptor = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+
+  if (_signalFileDescriptor < 0) {
+    logError("Failed to watch signals: %s", strerror(errno));
+
+    return false;
+  }
+
+  return watch(_signalFileDescriptor, &_signalFileDescriptor);
+}
+
+static void logLatency(char const* stage, LatencyHistogram const& histogram) {
+  logInfo("  %-9s p50 %8.1f us  p99 %8.1f us  p99.9 %8.1f us  max %8.1f us",
+          stage,
+          histogram.percentile(0.5) / 1e3,
+          histogram.percentile(0.99) / 1e3,
+          histogram.percentile(0.999) / 1e3,
+          histogram.max() / 1e3);
+}
+
+void Daemon::logLatencies() {
+  struct signalfd_siginfo information;
+
+  while (read(_signalFileDescriptor, &information, sizeof(information)) > 0) {
+  }
+
+  for (auto const& device : _devices) {
+    StageLatencies const& latencies = device.second->metrics()->latencies;
+
+    logInfo("%s (%s), %llu key events",
+            device.second->path().c_str(),
+            device.second->name().c_str(),
+            (unsigned long long)latencies.total.count());
+
+    logLatency("wakeup", latencies.wakeup);
+    logLatency("remap", latencies.remap);
+    logLatency("injection", latencies.injection);
+    logLatency("total", latencies.total);
+  }
+}
+
+void Daemon::startReload() {
+  if (_reloadThread.joinable()) {
+    // Reloaded again once the running reload is published
+    _isReloadRequested = true;
+
+    return;
+  }
+
+  std::vector<std::pair<unsigned, DeviceIdentity>> identities;
+
+  for (auto& device : _devices) {
+    identities.emplace_back(device.first, device.second->identity());
+  }
+
+  logInfo("Reloading %s", _configPath.c_str());
+
+  _reloadThread = std::thread([this, identities]() {
+    // Compiles off the CPU (and the priority) of the forwarding loop
+    leaveRealtime();
+
+    std::unique_ptr<Reload> reload(new Reload());
+
+    reload->isValid = reload->config.load(_configPath);
+
+    if (reload->isValid) {
+      for (auto const& identity : identities) {
+        reload->keymaps[identity.first] = reload->config.compile(identity.second);
+      }
+    }
+
+    delete _reload.exchange(reload.release(), std::memory_order_acq_rel);
+
+    eventfd_write(_reloadFileDescriptor, 1);
+  });
+}
+
+void Daemon::finishReload() {
+  eventfd_t value;
+
+  if (eventfd_read(_reloadFileDescriptor, &value) != 0) {
+    return;
+  }
+
+  _reloadThread.join();
+
+  std::unique_ptr<Reload> reload(_reload.exchange(nullptr, std::memory_order_acq_rel));
+
+  if (reload && reload->isValid) {
+    _config = reload->config;
+
+    for (auto& device : _devices) {
+      auto keymap = reload->keymaps.find(device.first);
+
+      // Devices attached while the keymaps were compiled get theirs now
+      if (keymap == reload->keymaps.end()) {
+        device.second->setKeymap(_config.compile(device.second->identity()));
+      } else {
+        device.second->setKeymap(keymap->second);
+      }
+    }
+
+    logInfo("Reloaded %s", _configPath.c_str());
+  } else {
+    logError("Keeping the current keymap, %s is not valid", _configPath.c_str());
+  }
+
+  if (_isReloadRequested) {
+    _isReloadRequested = false;
+
+    startReload();
+  }
+}
+
+bool Daemon::checkEventPaths() const {
+  bool isClean = true;
+
+  for (auto const& device : _devices) {
+    if (!checkEventPath(_config.compile(device.second->identity()))) {
+      logError("The keymap of %s is not fit for real time", device.second->path().c_str());
+
+      isClean = false;
+    }
+  }
+
+  return isClean;
+}
+
+// Polls for up to the spin window before it sleeps, the window follows the
+// gaps between the events. Both return what epoll_wait() does.
+template <typename Poll, typename Sleep>
+static int
+spinThenSleep(std::int64_t* spinWindow, std::int64_t maxSpinWindow, Poll poll, Sleep sleep) {
+  std::int64_t const start = monotonicNow();
+
+  while (*spinWindow > 0) {
+    int count = poll();
+    std::int64_t const elapsed = monotonicNow() - start;
+
+    if (count != 0) {
+      // Caught in time, the next gap may be as long
+      if (count > 0) {
+        *spinWindow = std::min(maxSpinWindow, std::max(*spinWindow, 2 * elapsed));
+      }
+
+      return count;
+    }
+
+    if (elapsed >= *spinWindow) {
+      // Missed, the burst is likely over. Misses in a row bring the window
+      // down to nothing, an idle loop only sleeps.
+      *spinWindow /= 2;
+
+      if (*spinWindow < minSpinWindow) {
+        *spinWindow = 0;
+      }
+
+      break;
+    }
+  }
+
+  if (maxSpinWindow == 0) {
+    return sleep();
+  }
+
+  std::int64_t const sleepStart = monotonicNow();
+  int count = sleep();
+  std::int64_t const slept = monotonicNow() - sleepStart;
+
+  // A window twice the gap would have caught the event, events as close as
+  // this are a burst
+  if (count > 0 && 2 * slept <= maxSpinWindow) {
+    *spinWindow = std::max(minSpinWindow, std::max(*spinWindow, 2 * slept));
+  }
+
+  return count;
+}
+
+void Daemon::setMaxSpin(unsigned microseconds) {
+  _maxSpinWindow = (std::int64_t)microseconds * 1000;
+  _spinWindow = 0;
+}
+
+int Daemon::wait(struct epoll_event* events) {
+  int const epoll = _epollFileDescriptor;
+
+  return spinThenSleep(
+    &_spinWindow,
+    _maxSpinWindow,
+    [epoll, events]() { return epoll_wait(epoll, events, maxEpollEvents, 0); },
+    [epoll, events]() { return epoll_wait(epoll, events, maxEpollEvents, -1); });
+}
+
+bool Daemon::dispatch(struct epoll_event const* events, int count) {
+  for (int i = 0; i < count; ++i) {
+    if (events[i].data.ptr == &_inotifyFileDescriptor) {
+      handleInotifyEvents();
+
+      continue;
+    }
+
+    if (events[i].data.ptr == &_reloadFileDescriptor) {
+      finishReload();
+
+      continue;
+    }
+
+    if (events[i].data.ptr == &_signalFileDescriptor) {
+      logLatencies();
+
+      continue;
+    }
+
+    if (events[i].data.ptr == &_handoffFileDescriptor) {
+      if (handOver()) {
+        logInfo("Handed %zu devices over", _devices.size());
+
+        return true;
+      }
+
+      continue;
+    }
+
+    Device* device = static_cast<Device*>(events[i].data.ptr);
+
+    if (!device->forward() || (events[i].events & (EPOLLERR | EPOLLHUP)) != 0) {
+      removeDevice(device);
+    }
+  }
+
+  return false;
+}
+
+int Daemon::run() {
+#ifdef KEYBOARD_HOOK_READER_IO_URING
+  if (_ring.isCreated()) {
+    return runRing();
+  }
+#endif
+
+  struct epoll_event events[maxEpollEvents];
+
+  while (!_devices.empty() || _devicesWatch >= 0) {
+    int count = wait(events);
+
+    if (count < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      logError("Failed to wait for events: %s", strerror(errno));
+
+      return -1;
+    }
+
+    if (dispatch(events, count)) {
+      return 0;
+    }
+  }
+
+  logInfo("No devices left to forward");
+
+  return 0;
+}
+
+#ifdef KEYBOARD_HOOK_READER_IO_URING
+int Daemon::runRing() {
+  struct epoll_event events[maxEpollEvents];
+
+  while (!_devices.empty() || _devicesWatch >= 0) {
+    // Everything else stays with epoll, its descriptor is polled through the
+    // ring
+    if (_isControlReady) {
+      int count;
+
+      do {
+        count = epoll_wait(_epollFileDescriptor, events, maxEpollEvents, 0);
+
+        if (dispatch(events, count)) {
+          return 0;
+        }
+      } while (count == maxEpollEvents);
+
+      if (!_ring.poll(_epollFileDescriptor, ringData(0, 0, ringControl))) {
+        logError("Failed to poll for events through io_uring");
+
+        return -1;
+      }
+
+      _isControlReady = false;
+    }
+
+    ringDoorbells();
+
+    int count = waitRing();
+
+    reapCompletions();
+
+    if (count < 0 && errno != EINTR && errno != EBUSY) {
+      logError("Failed to wait for events: %s", strerror(errno));
+
+      return -1;
+    }
+  }
+
+  logInfo("No devices left to forward");
+
+  return 0;
+}
+
+int Daemon::waitRing() {
+  // The doorbells go out before polling for completions
+  if (_spinWindow > 0) {
+    int result = _ring.enter(0);
+
+    if (result < 0) {
+      errno = -result;
+
+      return -1;
+    }
+  }
+
+  return spinThenSleep(
+    &_spinWindow,
+    _maxSpinWindow,
+    [this]() { return _ring.isCompleted() ? 1 : 0; },
+    [this]() {
+      int result = _ring.enter(1);
+
+      if (result < 0) {
+        errno = -result;
+
+        return -1;
+      }
+
+      return 1;
+    });
+}
+
+bool Daemon::startReading(Device* device) {
+  int const output = device->outputFileDescriptor();
+  int const flags = fcntl(output, F_GETFL);
+
+  // A non-blocking doorbell is written right in io_uring_enter(), on this
+  // thread and in the order the doorbells are queued, instead of by a worker
+  if (flags < 0 || fcntl(output, F_SETFL, flags | O_NONBLOCK) != 0) {
+    logError("Failed to make the writer of %s non-blocking: %s",
+             device->path().c_str(),
+             strerror(errno));
+
+    return false;
+  }
+
+  RingDevice& ringDevice = _ringDevices[device->number()];
+
+  ringDevice.generation = ++_ringGeneration;
+  ringDevice.isRinging = false;
+  ringDevice.isReading
+    = _ring.read(device->fileDescriptor(),
+                 ringData(device->number(), ringDevice.generation, ringRead));
+
+  if (!ringDevice.isReading) {
+    logError("Failed to read %s through io_uring", device->path().c_str());
+
+    _ringDevices.erase(device->number());
+
+    return false;
+  }
+
+  return true;
+}
+
+void Daemon::stopReading() {
+  for (auto& ringDevice : _ringDevices) {
+    ringDevice.second.isReading = false;
+  }
+
+  for (auto const& device : _devices) {
+    _ring.cancel(device.second->fileDescriptor());
+  }
+
+  // The writers are rung by the devices themselves from now on, not while a
+  // doorbell of the ring may still run
+  while (true) {
+    reapCompletions();
+
+    bool isRinging = false;
+
+    for (auto const& ringDevice : _ringDevices) {
+      isRinging = isRinging || ringDevice.second.isRinging;
+    }
+
+    if (!isRinging) {
+      return;
+    }
+
+    int result = _ring.enter(1);
+
+    if (result < 0 && result != -EINTR) {
+      return;
+    }
+  }
+}
+
+void Daemon::resumeReading() {
+  for (auto entry = _devices.begin(); entry != _devices.end();) {
+    Device* device = (entry++)->second.get();
+
+    if (!startReading(device)) {
+      removeDevice(device);
+    }
+  }
+}
+
+void Daemon::ringDoorbells() {
+  for (auto entry = _ringDevices.begin(); entry != _ringDevices.end();) {
+    unsigned const number = entry->first;
+    RingDevice& ringDevice = (entry++)->second;
+    Device* device = _devices.at(number).get();
+
+    // A doorbell injects everything in the ring of the device, one at a time
+    // is enough
+    if (ringDevice.isRinging || !device->takeDoorbell()) {
+      continue;
+    }
+
+    if (_ring.write(device->outputFileDescriptor(),
+                    &doorbell,
+                    sizeof(doorbell),
+                    ringData(number, ringDevice.generation, ringWrite))) {
+      ringDevice.isRinging = true;
+
+      continue;
+    }
+
+    // The ring is full, the writer is rung right away
+    ssize_t result = write(device->outputFileDescriptor(), &doorbell, sizeof(doorbell));
+
+    if (!device->doorbellRung(result < 0 ? -errno : result)) {
+      removeDevice(device);
+    }
+  }
+}
+
+void Daemon::reapCompletions() {
+  IoRing::Completion completion;
+
+  while (_ring.complete(&completion)) {
+    if ((completion.data & 3) == ringControl) {
+      _isControlReady = true;
+
+      continue;
+    }
+
+    handleCompletion(completion);
+  }
+}
+
+void Daemon::handleCompletion(IoRing::Completion const& completion) {
+  unsigned const number = (std::uint32_t)completion.data >> 2;
+  auto ringDevice = _ringDevices.find(number);
+  auto device = _devices.find(number);
+
+  // Left over from a device that is gone
+  if (ringDevice == _ringDevices.end() || device == _devices.end()
+      || ringDevice->second.generation != completion.data >> 32) {
+    _ring.recycle(completion);
+
+    return;
+  }
+
+  if ((completion.data & 3) == ringWrite) {
+    ringDevice->second.isRinging = false;
+
+    if (!device->second->doorbellRung(completion.result)) {
+      removeDevice(device->second.get());
+    }
+
+    return;
+  }
+
+  void* buffer = _ring.buffer(completion);
+  bool isForwarded = true;
+
+  if (buffer != NULL && completion.result > 0) {
+    isForwarded = device->second->forward(static_cast<struct input_event*>(buffer),
+                                          completion.result / sizeof(struct input_event));
+  }
+
+  _ring.recycle(completion);
+
+  if (!isForwarded) {
+    removeDevice(device->second.get());
+
+    return;
+  }
+
+  // The read goes on, or was stopped for the handoff
+  if ((completion.flags & IORING_CQE_F_MORE) != 0 || !ringDevice->second.isReading) {
+    return;
+  }
+
+  // It ran out of buffers, read on once they are back
+  if (completion.result > 0 || completion.result == -ENOBUFS) {
+    ringDevice->second.isReading
+      = _ring.read(device->second->fileDescriptor(), completion.data);
+
+    if (ringDevice->second.isReading) {
+      return;
+    }
+  }
+
+  if (completion.result < 0 && completion.result != -ENODEV) {
+    logError("Failed to read events of %s: %s",
+             device->second->path().c_str(),
+             strerror(-completion.result));
+  }
+
+  removeDevice(device->second.get());
+}
+#endif
+} // namespace Reader
+} // namespace KeyboardHook
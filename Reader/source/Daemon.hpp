@@ -0,0 +1,185 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Device.hpp"
+#include "KeymapConfig.hpp"
+#include "Metrics.hpp"
+
+#ifdef KEYBOARD_HOOK_READER_IO_URING
+#include "IoRing.hpp"
+#endif
+
+struct epoll_event;
+
+namespace KeyboardHook {
+namespace Reader {
+// Forwards the events of all hooked devices in a single epoll loop
+class Daemon {
+public:
+  Daemon(std::string const& configPath);
+
+  Daemon(Daemon const&) = delete;
+
+  ~Daemon();
+
+  Daemon& operator=(Daemon const&) = delete;
+
+  // Reads the keymap configuration, the default keymap is used if there is no
+  // configuration file. Returns false if it is malformed.
+  bool loadConfig();
+
+  // Hooks every keyboard found in /dev/input
+  void addKeyboards();
+
+  // Hooks /dev/input/event<number>, returns false if it could not be attached
+  bool addDevice(unsigned number);
+
+  // Watches /dev/input, keyboards are hooked as soon as they appear and
+  // released when they are gone
+  bool watchDevices();
+
+  // Watches the configuration file, a saved keymap replaces the current one
+  // without restarting
+  bool watchConfig();
+
+  // Serves the counters of the devices on a Unix socket
+  bool serveMetrics();
+
+  // Logs the latencies of the devices on SIGUSR1
+  bool watchSignals();
+
+  // Takes the devices over from the running daemon, without a gap in which
+  // their events are lost. Returns false if the handoff failed, or if there
+  // is no daemon to take them from and one isRequired.
+  bool takeOver(bool isRequired);
+
+  // Lets a newer daemon take the devices over, see takeOver()
+  bool listenForHandoff();
+
+  // After forwarding, the loop polls for the next event of a burst for up to
+  // microseconds before it sleeps, 0 (the default) never polls. How long it
+  // polls adapts to the pace of the events, it does not while they are apart.
+  void setMaxSpin(unsigned microseconds);
+
+  // Runs the keymap of every device through checkEventPath(), returns false if
+  // any of them faults or allocates
+  bool checkEventPaths() const;
+
+  // Runs until the loop fails, until the devices are handed over, or until all
+  // the devices are gone if they are not watched. Built with io_uring, the
+  // devices are forwarded through it if the kernel supports it.
+  int run();
+
+private:
+  // Configuration and keymaps compiled off the forwarding loop
+  struct Reload {
+    bool isValid;
+    KeymapConfig config;
+    std::map<unsigned, std::shared_ptr<Keymap const>> keymaps;
+  };
+
+  void addKeyboard(unsigned number);
+
+  // Watches a device that is ready to forward
+  bool startDevice(std::unique_ptr<Device> device);
+
+  void removeDevice(Device* device);
+
+  // Hands the devices over to the daemon connecting, returns true once it
+  // confirmed taking them
+  bool handOver();
+
+  bool watch(int fileDescriptor, void* data);
+
+  // Has the events of the device read through the ring or through epoll
+  bool watchDevice(Device* device);
+
+  void unwatchDevice(Device* device);
+
+  // Waits for events, polling first while a burst is likely to go on
+  int wait(struct epoll_event* events);
+
+  // Handles what epoll reported, returns true once the devices are handed over
+  bool dispatch(struct epoll_event const* events, int count);
+
+#ifdef KEYBOARD_HOOK_READER_IO_URING
+  // Reads of a device and the doorbells of its writer on the ring
+  struct RingDevice {
+    // Tells the completions of the device from those of a device it replaced
+    std::uint32_t generation;
+    bool isReading;
+    bool isRinging;
+  };
+
+  // Forwards all the devices through the ring, with a single io_uring_enter()
+  // per wakeup that rings the writers and waits for the next reads
+  int runRing();
+
+  int waitRing();
+
+  bool startReading(Device* device);
+
+  // Stops the reads before the devices are handed over, what they read so far
+  // is forwarded
+  void stopReading();
+
+  void resumeReading();
+
+  void ringDoorbells();
+
+  void reapCompletions();
+
+  void handleCompletion(IoRing::Completion const& completion);
+#endif
+
+  bool createInotify();
+
+  void handleInotifyEvents();
+
+  void startReload();
+
+  void finishReload();
+
+  void logLatencies();
+
+  int _epollFileDescriptor;
+  int _inotifyFileDescriptor;
+  int _devicesWatch;
+  int _configWatch;
+  int _reloadFileDescriptor;
+  int _handoffFileDescriptor;
+  int _signalFileDescriptor;
+  std::string _configPath;
+  std::string _configName;
+  KeymapConfig _config;
+  std::thread _reloadThread;
+  bool _isReloadRequested;
+  std::atomic<Reload*> _reload;
+  // Nanoseconds the loop polls before it sleeps, and their limit
+  std::int64_t _spinWindow;
+  std::int64_t _maxSpinWindow;
+  MetricsServer _metrics;
+  std::map<unsigned, std::unique_ptr<Device>> _devices;
+#ifdef KEYBOARD_HOOK_READER_IO_URING
+  IoRing _ring;
+  std::map<unsigned, RingDevice> _ringDevices;
+  std::uint32_t _ringGeneration;
+  // Epoll has events for the loop, it is polled through the ring
+  bool _isControlReady;
+#endif
+};
+
+// True for the virtual keyboards created by the writer
+bool isHookDevice(std::string const& name);
+
+// True for the devices the daemon hooks without being asked explicitly
+bool isKeyboard(std::string const& name);
+} // namespace Reader
+} // namespace KeyboardHook
@@ -0,0 +1,802 @@
+#include "Device.hpp"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <libevdev-1.0/libevdev/libevdev.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "keyboard_hook_writer_uapi.h"
+#include "log.hpp"
+
+#define KEYBOARD_HOOK_READER_INPUT_DIRECTORY "/dev/input"
+
+#define KEYBOARD_HOOK_WRITER_INPUT_KEYBOARD_DEVICE_MASTER "/dev/input/event"
+
+#define KEYBOARD_HOOK_WRITER_DEVICE_INFO_BUFFER_DEVICE_PATH                              \
+  "/dev/keyboard_hook_writer_device_info_buffer"
+
+#define KEYBOARD_HOOK_WRITER_INPUT_KEYBOARD_DEVICE_PATH                                  \
+  "/dev/keyboard_hook_writer_input_keyboard"
+
+namespace KeyboardHook {
+namespace Reader {
+typedef std::vector<unsigned char> Buffer;
+
+// Event types whose capabilities the writer copies, 0 stands for the types
+// themselves
+static unsigned const describedTypes[] = {0, EV_KEY, EV_REL, EV_MSC, EV_LED, EV_SND, EV_SW};
+
+static std::int64_t monotonicNow() {
+  struct timespec time;
+
+  clock_gettime(CLOCK_MONOTONIC, &time);
+
+  return (std::int64_t)time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+static std::int64_t toNanoseconds(struct timeval const& time) {
+  return (std::int64_t)time.tv_sec * 1000000000 + (std::int64_t)time.tv_usec * 1000;
+}
+
+static void appendToBuffer(Buffer* buffer, void const* data, std::size_t size) {
+  unsigned char const* bytes = static_cast<unsigned char const*>(data);
+
+  buffer->insert(buffer->end(), bytes, bytes + size);
+}
+
+static void copyName(char* destination, std::string const& name) {
+  std::size_t size = std::min(name.size(), (std::size_t)KEYBOARD_HOOK_WRITER_NAME_SIZE - 1);
+
+  std::memcpy(destination, name.data(), size);
+  destination[size] = '\0';
+}
+
+// The name and ids of the device followed by its capability bitmaps as the
+// kernel reports them
+bool describeDevice(unsigned number,
+                    int fileDescriptor,
+                    struct libevdev* dev,
+                    Buffer* buffer) {
+  struct keyboard_hook_writer_descriptor descriptor = {};
+
+  descriptor.magic = KEYBOARD_HOOK_WRITER_DESCRIPTOR_MAGIC;
+  descriptor.version = KEYBOARD_HOOK_WRITER_DESCRIPTOR_VERSION;
+  descriptor.number = number;
+  descriptor.id.bustype = libevdev_get_id_bustype(dev);
+  descriptor.id.vendor = libevdev_get_id_vendor(dev);
+  descriptor.id.product = libevdev_get_id_product(dev);
+  descriptor.id.version = libevdev_get_id_version(dev);
+
+  // The suffix tells the virtual keyboard from the physical ones, a long name
+  // is cut before it
+  std::string const suffix = " KH" + std::to_string(number);
+  char const* name = libevdev_get_name(dev);
+  char const* phys = libevdev_get_phys(dev);
+
+  std::string deviceName(name != NULL ? name : "");
+  deviceName.resize(
+    std::min(deviceName.size(), KEYBOARD_HOOK_WRITER_NAME_SIZE - 1 - suffix.size()));
+  copyName(descriptor.name, deviceName + suffix);
+  copyName(descriptor.phys, phys != NULL ? phys : "");
+
+  static std::size_t const longBits = 8 * sizeof(unsigned long);
+
+  // Large enough for the largest bitmap, the one of the keys
+  unsigned long bits[(KEY_CNT + longBits - 1) / longBits];
+  Buffer bitmaps;
+
+  for (unsigned type : describedTypes) {
+    if (type != 0 && !libevdev_has_event_type(dev, type)) {
+      continue;
+    }
+
+    int size = ioctl(fileDescriptor, EVIOCGBIT(type, sizeof(bits)), bits);
+
+    if (size < 0) {
+      logError("Failed to query the capabilities of device %u: %s", number, strerror(errno));
+
+      return false;
+    }
+
+    struct keyboard_hook_writer_bitmap bitmap;
+    bitmap.type = type;
+    bitmap.size = size;
+
+    appendToBuffer(&bitmaps, &bitmap, sizeof(bitmap));
+    appendToBuffer(&bitmaps, bits, size);
+
+    ++descriptor.bitmap_count;
+  }
+
+  buffer->clear();
+  appendToBuffer(buffer, &descriptor, sizeof(descriptor));
+  buffer->insert(buffer->end(), bitmaps.begin(), bitmaps.end());
+
+  return true;
+}
+
+Device::Device(unsigned number)
+  : _number(number),
+    _path(KEYBOARD_HOOK_WRITER_INPUT_KEYBOARD_DEVICE_MASTER + std::to_string(number)),
+    _fileDescriptor(-1),
+    _device(NULL),
+    _outputFileDescriptor(-1),
+    _ring(NULL),
+    _isDoorbellPending(false),
+    _isGrabbed(false),
+    _isDropped(false),
+    _isRemappedInKernel(false),
+    _reportedOverflowCount(0),
+    _readTime(0),
+    _stampCount(0),
+    _flushedStampCount(0),
+    _droppedTime(0),
+    _metrics(std::make_shared<DeviceMetrics>()) {}
+
+Device::~Device() {
+  if (_ring != NULL) {
+    munmap(_ring, sizeof(struct keyboard_hook_writer_ring));
+  }
+
+  if (_outputFileDescriptor > 0) {
+    close(_outputFileDescriptor);
+  }
+
+  if (_device != NULL) {
+    libevdev_free(_device);
+  }
+
+  if (_fileDescriptor > 0) {
+    close(_fileDescriptor);
+  }
+}
+
+std::string Device::name() const {
+  if (_device == NULL || libevdev_get_name(_device) == NULL) {
+    return std::string();
+  }
+
+  return libevdev_get_name(_device);
+}
+
+DeviceIdentity Device::identity() const {
+  DeviceIdentity identity;
+
+  identity.name = name();
+  identity.bustype = libevdev_get_id_bustype(_device);
+  identity.vendor = libevdev_get_id_vendor(_device);
+  identity.product = libevdev_get_id_product(_device);
+
+  return identity;
+}
+
+void Device::setKeymap(std::shared_ptr<Keymap const> keymap) {
+  _pendingKeymap = std::move(keymap);
+
+  adoptKeymap();
+}
+
+void Device::adoptKeymap() {
+  // A device taken over with keys held has no keymap to release them with yet
+  if (!_eventHandler.keymap()
+      || (_frame.empty() && !_eventHandler.keyState().isAnyKeyPressed())) {
+    _eventHandler.setKeymap(std::move(_pendingKeymap));
+    _pendingKeymap.reset();
+
+    updateRemap();
+  }
+}
+
+void Device::updateRemap() {
+  if (_outputFileDescriptor < 0 || !_eventHandler.keymap()) {
+    return;
+  }
+
+  Keymap const& keymap = *_eventHandler.keymap();
+
+  if (keymap.isPlainRemap()) {
+    struct keyboard_hook_writer_remap remap;
+
+    for (KeyCode code = 0; code < KEY_CNT; ++code) {
+      remap.codes[code] = keymap[code].action == Action::Drop
+                            ? KEYBOARD_HOOK_WRITER_REMAP_DROP
+                            : keymap[code].code;
+    }
+
+    // Events of a grabbed device bypass the filter of the writer, so it is
+    // released only once the writer remaps
+    if (ioctl(_outputFileDescriptor, KEYBOARD_HOOK_WRITER_SET_REMAP, &remap) == 0) {
+      if (!_isRemappedInKernel) {
+        logInfo("Remapping %s in the writer", _path.c_str());
+      }
+
+      _isRemappedInKernel = true;
+      _metrics->isRemappedInKernel.set(1);
+
+      ungrab();
+
+      return;
+    }
+
+    logError("Failed to remap %s in the writer: %s", _path.c_str(), strerror(errno));
+  }
+
+  if (_isRemappedInKernel) {
+    // Grabbed first, so that no event reaches the system unmapped
+    grab();
+
+    ioctl(_outputFileDescriptor, KEYBOARD_HOOK_WRITER_CLEAR_REMAP);
+
+    _isRemappedInKernel = false;
+    _metrics->isRemappedInKernel.set(0);
+  }
+}
+
+bool Device::open() {
+  _fileDescriptor = ::open(_path.c_str(), O_RDONLY | O_NONBLOCK);
+
+  if (_fileDescriptor < 0) {
+    return false;
+  }
+
+  // Events are stamped on the clock the stages are timed with
+  int clock = CLOCK_MONOTONIC;
+  ioctl(_fileDescriptor, EVIOCSCLOCKID, &clock);
+
+  int err = libevdev_new_from_fd(_fileDescriptor, &_device);
+
+  if (err < 0) {
+    logError("Failed to open input device %s (errno %d): %s",
+             _path.c_str(),
+             -err,
+             strerror(-err));
+
+    _device = NULL;
+
+    return false;
+  }
+
+  return true;
+}
+
+bool Device::attach() {
+  Buffer deviceInfo;
+
+  if (!describeDevice(_number, _fileDescriptor, _device, &deviceInfo)) {
+    return false;
+  }
+
+  return attach(deviceInfo);
+}
+
+bool Device::attach(Buffer const& descriptor) {
+  struct keyboard_hook_writer_descriptor header;
+
+  if (descriptor.size() < sizeof(header)) {
+    logError("Invalid descriptor for %s", _path.c_str());
+
+    return false;
+  }
+
+  Buffer deviceInfo(descriptor);
+
+  std::memcpy(&header, deviceInfo.data(), sizeof(header));
+  header.number = _number;
+  std::memcpy(deviceInfo.data(), &header, sizeof(header));
+
+  int infoFileDescriptor
+    = ::open(KEYBOARD_HOOK_WRITER_DEVICE_INFO_BUFFER_DEVICE_PATH, O_WRONLY | O_SYNC);
+
+  if (infoFileDescriptor <= 0) {
+    logError("Failed to open %s", KEYBOARD_HOOK_WRITER_DEVICE_INFO_BUFFER_DEVICE_PATH);
+
+    return false;
+  }
+
+  int result
+    = write(infoFileDescriptor, deviceInfo.data(), sizeof(char) * deviceInfo.size());
+
+  if (result < 0) {
+    logError("Failed to write the device info");
+
+    close(infoFileDescriptor);
+
+    return false;
+  }
+
+  result = close(infoFileDescriptor);
+
+  if (result < 0) {
+    logError("Failed to submit the device info");
+
+    return false;
+  }
+
+  std::string outputDeviceName(KEYBOARD_HOOK_WRITER_INPUT_KEYBOARD_DEVICE_PATH);
+  outputDeviceName += std::to_string(_number);
+
+  // Read access is needed to map the ring
+  _outputFileDescriptor = ::open(outputDeviceName.c_str(), O_RDWR);
+
+  if (_outputFileDescriptor <= 0) {
+    logError("Failed to open %s", outputDeviceName.c_str());
+
+    return false;
+  }
+
+  mapRing();
+
+  logInfo("Attached %s (%s)", _path.c_str(), name().c_str());
+
+  updateRemap();
+
+  return true;
+}
+
+bool Device::takeOver(DeviceHandoff const& handoff,
+                      int fileDescriptor,
+                      int outputFileDescriptor) {
+  _fileDescriptor = fileDescriptor;
+  _outputFileDescriptor = outputFileDescriptor;
+
+  int err = libevdev_new_from_fd(_fileDescriptor, &_device);
+
+  if (err < 0) {
+    logError("Failed to take over input device %s (errno %d): %s",
+             _path.c_str(),
+             -err,
+             strerror(-err));
+
+    _device = NULL;
+
+    return false;
+  }
+
+  mapRing();
+
+  _isGrabbed = handoff.isGrabbed != 0;
+  _isDropped = handoff.isDropped != 0;
+  _isRemappedInKernel = handoff.isRemappedInKernel != 0;
+  _metrics->isGrabbed.set(_isGrabbed);
+  _metrics->isRemappedInKernel.set(_isRemappedInKernel);
+  _eventHandler.restore(handoff.handler);
+
+  logInfo("Took over %s (%s)", _path.c_str(), name().c_str());
+
+  return true;
+}
+
+DeviceHandoff Device::handOver() {
+  DeviceHandoff handoff = {};
+
+  flushEvents();
+  ringDoorbell();
+
+  handoff.number = _number;
+  handoff.isGrabbed = _isGrabbed;
+  handoff.isDropped = _isDropped;
+  handoff.isRemappedInKernel = _isRemappedInKernel;
+  handoff.handler = _eventHandler.snapshot();
+
+  return handoff;
+}
+
+void Device::mapRing() {
+  void* ring = mmap(NULL,
+                    sizeof(struct keyboard_hook_writer_ring),
+                    PROT_READ | PROT_WRITE,
+                    MAP_SHARED,
+                    _outputFileDescriptor,
+                    0);
+
+  if (ring == MAP_FAILED) {
+    logInfo("Writing the events of %s without a ring: %s", _path.c_str(), strerror(errno));
+
+    return;
+  }
+
+  _ring = static_cast<struct keyboard_hook_writer_ring*>(ring);
+}
+
+int Device::grab() {
+  if (_isGrabbed) {
+    return 0;
+  }
+
+  // Not through libevdev, which does not know of a grab taken over along
+  // with the descriptor
+  if (ioctl(_fileDescriptor, EVIOCGRAB, 1) != 0) {
+    int err = -errno;
+
+    logError("Failed to grab input device %s: %s", _path.c_str(), strerror(-err));
+
+    return err;
+  }
+
+  _isGrabbed = true;
+  _metrics->isGrabbed.set(1);
+
+  return 0;
+}
+
+void Device::ungrab() {
+  if (!_isGrabbed) {
+    return;
+  }
+
+  ioctl(_fileDescriptor, EVIOCGRAB, 0);
+
+  _isGrabbed = false;
+  _metrics->isGrabbed.set(0);
+}
+
+int Device::writeEvents(struct input_event const* events, size_t count) {
+  static std::uint32_t const ringSize = KEYBOARD_HOOK_WRITER_RING_SIZE;
+
+  if (_ring != NULL && count <= ringSize) {
+    std::uint32_t const head = _ring->head;
+
+    // The writer drains the whole ring before the doorbell returns. A doorbell
+    // taken by takeDoorbell() may not have been rung yet, this one is owed
+    // either way.
+    if (head - __atomic_load_n(&_ring->tail, __ATOMIC_ACQUIRE) + count > ringSize) {
+      _isDoorbellPending = true;
+
+      if (ringDoorbell() != 0) {
+        return -1;
+      }
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+      _ring->events[(head + i) % ringSize] = events[i];
+    }
+
+    __atomic_store_n(&_ring->head, head + (std::uint32_t)count, __ATOMIC_RELEASE);
+
+    _metrics->ringHighWater.raise(head + count - __atomic_load_n(&_ring->tail, __ATOMIC_RELAXED));
+
+    _isDoorbellPending = true;
+
+    return 0;
+  }
+
+  // Events already in the ring go first
+  if (ringDoorbell() != 0) {
+    return -1;
+  }
+
+  size_t const size = sizeof(struct input_event) * count;
+
+  ssize_t result = write(_outputFileDescriptor, (void const*)events, size);
+
+  if (result < 0) {
+    _metrics->writeErrors.add();
+
+    logError("Failed to write %zu events", count);
+
+    return result;
+  }
+
+  if ((size_t)result != size) {
+    _metrics->writeErrors.add();
+
+    logError("Partially written frame %zd of %zu bytes", result, size);
+
+    return -1;
+  }
+
+  return 0;
+}
+
+int Device::ringDoorbell() {
+  if (!_isDoorbellPending) {
+    return 0;
+  }
+
+  char const doorbell = 0;
+
+  _isDoorbellPending = false;
+
+  ssize_t result = write(_outputFileDescriptor, &doorbell, sizeof(doorbell));
+
+  return doorbellRung(result < 0 ? -errno : result) ? 0 : -1;
+}
+
+bool Device::inject(struct input_event const* events, std::size_t count) {
+  return writeEvents(events, count) == 0 && ringDoorbell() == 0;
+}
+
+bool Device::takeDoorbell() {
+  bool isPending = _isDoorbellPending;
+
+  _isDoorbellPending = false;
+
+  return isPending;
+}
+
+bool Device::doorbellRung(ssize_t result) {
+  if (result != 1) {
+    _metrics->writeErrors.add();
+
+    logError("Failed to ring the writer of %s: %s",
+             _path.c_str(),
+             strerror(result < 0 ? -result : EIO));
+
+    return false;
+  }
+
+  recordInjected();
+
+  return true;
+}
+
+// Hands the events gathered so far to the writer at once, it injects them in
+// order
+int Device::flushEvents() {
+  if (_frame.overflowCount() != _reportedOverflowCount) {
+    logError("Dropped %llu events of %s, the frame buffer is full",
+             (unsigned long long)(_frame.overflowCount() - _reportedOverflowCount),
+             _path.c_str());
+
+    _reportedOverflowCount = _frame.overflowCount();
+  }
+
+  if (_frame.empty()) {
+    return 0;
+  }
+
+  _metrics->frameHighWater.raise(_frame.size());
+
+  int result = writeEvents(_frame.data(), _frame.size());
+
+  _frame.clear();
+
+  if (result == 0) {
+    _metrics->framesInjected.add();
+  }
+
+  // Events in the ring are taken once the doorbell rings
+  _flushedStampCount = _stampCount;
+
+  if (result == 0 && !_isDoorbellPending) {
+    recordInjected();
+  }
+
+  return result;
+}
+
+int Device::sendEvent(struct input_event* event) {
+  if (!_isGrabbed) {
+    return 0;
+  }
+
+  // The writer injects the parts of a frame in order all the same
+  bool isRemapped = false;
+  int result = forwardEvent(
+    &_eventHandler, &_frame, event, [this]() { return flushEvents(); }, &isRemapped);
+
+  if (isRemapped) {
+    _metrics->eventsRemapped.add();
+  }
+
+  if (event->type == EV_SYN && event->code == SYN_REPORT && _pendingKeymap) {
+    adoptKeymap();
+  }
+
+  return result;
+}
+
+// Brings the key state in line with the keys actually held after the kernel
+// dropped events, sending the missed releases first and then the missed presses
+int Device::resync(struct timeval const* time) {
+  static std::size_t const longBits = 8 * sizeof(unsigned long);
+
+  unsigned long keys[(KEY_CNT + longBits - 1) / longBits] = {};
+
+  if (ioctl(_fileDescriptor, EVIOCGKEY(sizeof(keys)), keys) < 0) {
+    logError("Failed to query the keys of %s: %s", _path.c_str(), strerror(errno));
+
+    return -1;
+  }
+
+  struct input_event event;
+  event.time = *time;
+
+  for (bool isPressed : {false, true}) {
+    for (KeyCode code = 0; code < KEY_CNT; ++code) {
+      bool isHeld = (keys[code / longBits] >> (code % longBits)) & 1;
+
+      if (isHeld != isPressed || isHeld == _eventHandler.keyState().isPressed(code)) {
+        continue;
+      }
+
+      event.type = EV_KEY;
+      event.code = code;
+      event.value = isPressed;
+
+      if (sendEvent(&event) != 0) {
+        return -1;
+      }
+    }
+  }
+
+  event.type = EV_SYN;
+  event.code = SYN_REPORT;
+  event.value = 0;
+
+  return sendEvent(&event);
+}
+
+int Device::receiveEvent(struct input_event* event) {
+  bool const isReport = event->type == EV_SYN && event->code == SYN_REPORT;
+
+  // Everything up to the next report belongs to the frame events were dropped
+  // from
+  if (_isDropped) {
+    if (!isReport) {
+      return 0;
+    }
+
+    _isDropped = false;
+
+    int result = resync(&event->time);
+
+    _metrics->resync.record(monotonicNow() - _droppedTime);
+
+    return result;
+  }
+
+  if (event->type == EV_SYN && event->code == SYN_DROPPED) {
+    _isDropped = true;
+    _droppedTime = toNanoseconds(event->time);
+    _metrics->droppedCount.add();
+
+    return 0;
+  }
+
+  // Grab between frames only, so that no key is left pressed behind the grab.
+  // The writer applies a plain remap itself, the device is left to it.
+  if (event->type == EV_SYN && !_isRemappedInKernel && grab() != 0) {
+    return -1;
+  }
+
+  if (event->type != EV_KEY || !_isGrabbed) {
+    return sendEvent(event);
+  }
+
+  std::int64_t const arrival = toNanoseconds(event->time);
+  int result = sendEvent(event);
+
+  stampKeyEvent(arrival);
+
+  return result;
+}
+
+void Device::stampKeyEvent(std::int64_t arrival) {
+  std::int64_t const handled = monotonicNow();
+
+  _metrics->latencies.wakeup.record(_readTime - arrival);
+  _metrics->latencies.remap.record(handled - _readTime);
+
+  if (_stampCount < _stamps.size()) {
+    _stamps[_stampCount++] = KeyStamp{arrival, handled};
+  }
+}
+
+void Device::recordInjected() {
+  if (_flushedStampCount == 0) {
+    return;
+  }
+
+  std::int64_t const injected = monotonicNow();
+
+  for (std::size_t i = 0; i < _flushedStampCount; ++i) {
+    _metrics->latencies.injection.record(injected - _stamps[i].handled);
+    _metrics->latencies.total.record(injected - _stamps[i].arrival);
+  }
+
+  std::copy(_stamps.begin() + _flushedStampCount,
+            _stamps.begin() + _stampCount,
+            _stamps.begin());
+
+  _stampCount -= _flushedStampCount;
+  _flushedStampCount = 0;
+}
+
+bool Device::forward() {
+  while (true) {
+    ssize_t size = read(_fileDescriptor, _readBuffer.data(), sizeof(_readBuffer));
+
+    if (size < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      if (errno == EAGAIN) {
+        return ringDoorbell() == 0;
+      }
+
+      logError("Failed to read events of %s: %s", _path.c_str(), strerror(errno));
+
+      return false;
+    }
+
+    size_t const count = size / sizeof(struct input_event);
+
+    if (count == 0) {
+      return false;
+    }
+
+    if (!forward(_readBuffer.data(), count)) {
+      return false;
+    }
+
+    // A short read has drained the device, the next events wake the loop again.
+    // The writer is woken once for everything read.
+    if (count < readCapacity) {
+      return ringDoorbell() == 0;
+    }
+  }
+}
+
+bool Device::forward(struct input_event* events, std::size_t count) {
+  _readTime = monotonicNow();
+  _metrics->eventsRead.add(count);
+
+  for (size_t i = 0; i < count; ++i) {
+    if (receiveEvent(&events[i]) != 0) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool parseDeviceNumber(char const* name, unsigned* number) {
+  if (strncmp(name, "event", 5) != 0 || !std::isdigit((unsigned char)name[5])) {
+    return false;
+  }
+
+  *number = std::strtoul(name + 5, NULL, 10);
+
+  return true;
+}
+
+std::vector<unsigned> findDevices() {
+  std::vector<unsigned> numbers;
+  DIR* directory = opendir(KEYBOARD_HOOK_READER_INPUT_DIRECTORY);
+
+  if (directory == NULL) {
+    logError("Failed to open %s", KEYBOARD_HOOK_READER_INPUT_DIRECTORY);
+
+    return numbers;
+  }
+
+  struct dirent* entry;
+  unsigned number;
+
+  while ((entry = readdir(directory)) != NULL) {
+    if (parseDeviceNumber(entry->d_name, &number)) {
+      numbers.push_back(number);
+    }
+  }
+
+  closedir(directory);
+
+  std::sort(numbers.begin(), numbers.end());
+
+  return numbers;
+}
+} // namespace Reader
+} // namespace KeyboardHook
@@ -0,0 +1,186 @@
+#pragma once
+
+#include <linux/input.h>
+#include <sys/types.h>
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "EventHandler.hpp"
+#include "KeymapConfig.hpp"
+#include "Metrics.hpp"
+
+struct keyboard_hook_writer_ring;
+struct libevdev;
+
+namespace KeyboardHook {
+namespace Reader {
+// State of a device handed over to another process, its evdev and writer
+// descriptors are sent along
+struct DeviceHandoff {
+  std::uint32_t number;
+  std::uint8_t isGrabbed;
+  std::uint8_t isDropped;
+  std::uint8_t isRemappedInKernel;
+  EventHandler::Snapshot handler;
+};
+
+// Forwarding context of a single input device: the grabbed evdev node, its
+// remapping state and the virtual keyboard of the writer it is injected into
+class Device {
+public:
+  // Events read from the evdev node with a single read()
+  static std::size_t const readCapacity = 64;
+
+  // Key events timed until the writer takes them, later ones go untimed
+  static std::size_t const stampCapacity = 2 * readCapacity;
+
+  Device(unsigned number);
+
+  Device(Device const&) = delete;
+
+  ~Device();
+
+  Device& operator=(Device const&) = delete;
+
+  unsigned number() const { return _number; }
+
+  std::string const& path() const { return _path; }
+
+  int fileDescriptor() const { return _fileDescriptor; }
+
+  int outputFileDescriptor() const { return _outputFileDescriptor; }
+
+  // Counters of the forwarding, and the time the key events of the device
+  // spent in each stage of the Reader
+  std::shared_ptr<DeviceMetrics const> metrics() const { return _metrics; }
+
+  // Name reported by the kernel, empty until the device is opened
+  std::string name() const;
+
+  // Name and ids of the device, the keymap configuration is matched against
+  DeviceIdentity identity() const;
+
+  // The keymap is replaced between frames once no key is held, so that every
+  // key is released through the keymap it was pressed with
+  void setKeymap(std::shared_ptr<Keymap const> keymap);
+
+  // Opens the evdev node (non-blocking), returns false if it is not an input
+  // device
+  bool open();
+
+  // Registers the virtual keyboard in the writer and opens it for injection
+  bool attach();
+
+  // Same as attach() from a descriptor of describeDevice(), the keyboard is
+  // registered under the number of this device. The device itself need not be
+  // there (or opened), its events are then passed to inject().
+  bool attach(std::vector<unsigned char> const& descriptor);
+
+  // Takes over the descriptors another process handed over, the device stays
+  // grabbed (or remapped in the writer) as it was there
+  bool takeOver(DeviceHandoff const& handoff, int fileDescriptor, int outputFileDescriptor);
+
+  // Injects the events forwarded so far and returns the state the device is
+  // taken over with
+  DeviceHandoff handOver();
+
+  // Forwards all pending events, returns false if the device is gone or
+  // forwarding failed
+  bool forward();
+
+  // Forwards events read from the device elsewhere, the writer is left to be
+  // woken through takeDoorbell()
+  bool forward(struct input_event* events, std::size_t count);
+
+  // True once if the writer has events of the device to inject, the caller
+  // writes the doorbell to outputFileDescriptor() and passes the result to
+  // doorbellRung()
+  bool takeDoorbell();
+
+  // Takes what the write of the doorbell returned, or a negative errno. Returns
+  // false if the doorbell failed.
+  bool doorbellRung(ssize_t result);
+
+  // Injects a frame remapped elsewhere the way forwarded ones are, returns
+  // false if the writer failed
+  bool inject(struct input_event const* events, std::size_t count);
+
+private:
+  // Times at which a key event passed the stages, in monotonic nanoseconds
+  struct KeyStamp {
+    std::int64_t arrival;
+    std::int64_t handled;
+  };
+
+  void adoptKeymap();
+
+  // Hands a keymap that only remaps keys over to the writer, which then
+  // applies it to the events of the device without them passing through here
+  void updateRemap();
+
+  // Maps the event ring of the writer, without it the events are written
+  void mapRing();
+
+  int grab();
+
+  void ungrab();
+
+  int receiveEvent(struct input_event* event);
+
+  void stampKeyEvent(std::int64_t arrival);
+
+  // Records the key events the writer has taken
+  void recordInjected();
+
+  int resync(struct timeval const* time);
+
+  int sendEvent(struct input_event* event);
+
+  int flushEvents();
+
+  int writeEvents(struct input_event const* events, size_t count);
+
+  // Has the writer inject the events appended to the ring
+  int ringDoorbell();
+
+  unsigned _number;
+  std::string _path;
+  int _fileDescriptor;
+  struct libevdev* _device;
+  int _outputFileDescriptor;
+  struct keyboard_hook_writer_ring* _ring;
+  bool _isDoorbellPending;
+  bool _isGrabbed;
+  bool _isDropped;
+  bool _isRemappedInKernel;
+  std::array<struct input_event, readCapacity> _readBuffer;
+  FrameBuffer _frame;
+  std::uint64_t _reportedOverflowCount;
+  EventHandler _eventHandler;
+  std::shared_ptr<Keymap const> _pendingKeymap;
+  std::int64_t _readTime;
+  std::array<KeyStamp, stampCapacity> _stamps;
+  std::size_t _stampCount;
+  std::size_t _flushedStampCount;
+  std::int64_t _droppedTime;
+  std::shared_ptr<DeviceMetrics> _metrics;
+};
+
+// Descriptor of the virtual keyboard of the opened device, as the writer takes
+// it, returns false (and logs why) if its capabilities cannot be queried
+bool describeDevice(unsigned number,
+                    int fileDescriptor,
+                    struct libevdev* dev,
+                    std::vector<unsigned char>* descriptor);
+
+// Parses the number N of an "eventN" node name, returns false for other names
+bool parseDeviceNumber(char const* name, unsigned* number);
+
+// Numbers of all the /dev/input/eventN nodes present
+std::vector<unsigned> findDevices();
+} // namespace Reader
+} // namespace KeyboardHook
@@ -1,430 +1,156 @@
 #include "EventHandler.hpp"
 
-#include <cstdio>
-
-typedef unsigned int KeyCode;
-
-struct input_event* createEvent() {
-  _eventQueue.emplace_back();
-  _isEventHandled = true;
-
-  return &_eventQueue.back();
-}
-
-void sendKeyEvent(struct timeval* time, int const& isPressed, KeyCode const& code) {
-  auto mscEvent = createEvent();
-  auto event = createEvent();
-  auto syncEvent = createEvent();
-
-  mscEvent->time = *time;
-  mscEvent->type = EV_MSC;
-  mscEvent->code = MSC_SCAN;
-  mscEvent->value = code;
-
-  event->time = *time;
-  event->type = EV_KEY;
-  event->code = code;
-  event->value = isPressed;
-
-  syncEvent->time = *time;
-  syncEvent->type = EV_SYN;
-  syncEvent->code = SYN_REPORT;
-  syncEvent->value = 0;
-}
-
 namespace KeyboardHook {
 namespace Reader {
-class Key {
-public:
-  Key(KeyCode const& code) : _code(code) {}
-
-  Key(Key const& other) : _code(other._code) {}
-
-  virtual ~Key() {}
-
-  Key& operator=(Key const& other) {
-    _code = other._code;
-
-    return *this;
-  }
-
-  KeyCode& code() { return _code; }
-
-  virtual void press(struct timeval* time) { sendKeyEvent(time, 1, _code); }
-
-  virtual void release(struct timeval* time) { sendKeyEvent(time, 0, _code); }
-
-private:
-  KeyCode _code;
-};
-
-class Modifier : public Key {
-public:
-  typedef Key Base;
-
-  Modifier(KeyCode const& code) : Base(code), _isPressed(false) {}
-
-  Modifier(Modifier const& other) : Base(other), _isPressed(other._isPressed) {}
-
-  virtual ~Modifier() {}
-
-  Modifier& operator=(Modifier const& other) {
-    this->Base::operator=(other);
-    _isPressed = other._isPressed;
-
-    return *this;
-  }
-
-  bool& isPressed() { return _isPressed; }
-
-  void saveState() { _previousState = _isPressed; }
-
-  virtual void press(struct timeval* time) {
-    if (!_isPressed) {
-      this->Base::press(time);
-      _isPressed = true;
-    }
-  }
-
-  virtual void release(struct timeval* time) {
-    if (_isPressed) {
-      this->Base::release(time);
-      _isPressed = false;
-    }
-  }
-
-  void restoreState(struct timeval* time) {
-    if (_previousState != _isPressed) {
-      if (_previousState) {
-        press(time);
-      } else {
-        release(time);
-      }
-    }
-  }
-
-private:
-  bool _isPressed;
-  bool _previousState;
-};
-} // namespace Reader
-} // namespace KeyboardHook
+static void createEvent(FrameBuffer* frame,
+                        struct timeval const* time,
+                        __u16 type,
+                        __u16 code,
+                        __s32 value) {
+  struct input_event event;
+
+  event.time = *time;
+  event.type = type;
+  event.code = code;
+  event.value = value;
+
+  frame->push(event);
+}
 
-static KeyboardHook::Reader::Modifier _altSemicolon(39);
-static KeyboardHook::Reader::Modifier _semicolonLeftAlt(56);
-static KeyboardHook::Reader::Modifier _semicolonRightAlt(100);
-static KeyboardHook::Reader::Modifier _semicolonLeftCtrl(29);
-static KeyboardHook::Reader::Modifier _semicolon(39);
-static KeyboardHook::Reader::Modifier _fakeBackspace(14);
-
-static KeyboardHook::Reader::Modifier _escape(1);
-static KeyboardHook::Reader::Modifier _capslock(58);
-static KeyboardHook::Reader::Modifier _germanShift(86);
-static KeyboardHook::Reader::Modifier _leftShift(42);
-static KeyboardHook::Reader::Modifier _rightShift(54);
-static KeyboardHook::Reader::Modifier _leftAlt(56);
-static KeyboardHook::Reader::Modifier _rightAlt(100);
-static KeyboardHook::Reader::Modifier _leftCtrl(29);
-static KeyboardHook::Reader::Modifier _rightCtrl(97);
-static KeyboardHook::Reader::Modifier _sysRq(99); // PtrSc
-static KeyboardHook::Reader::Modifier _compose(127);
-static KeyboardHook::Reader::Modifier _leftMeta(125);
-
-bool isShiftPressed() {
-  return _leftShift.isPressed() || _rightShift.isPressed() || _germanShift.isPressed();
+static void sendKeyEvent(FrameBuffer* frame,
+                         struct timeval const* time,
+                         int const& isPressed,
+                         KeyCode const& code) {
+  createEvent(frame, time, EV_MSC, MSC_SCAN, code);
+  createEvent(frame, time, EV_KEY, code, isPressed);
+  createEvent(frame, time, EV_SYN, SYN_REPORT, 0);
 }
 
-bool isAltPressed() { return _leftAlt.isPressed() || _rightAlt.isPressed(); }
+EventHandler::EventHandler() : _semicolonMode(SemicolonMode::None) {}
 
-bool handleCapsLock(struct input_event* event) {
-  if (event->type == EV_KEY && event->code == _capslock.code()) {
-    event->code = _escape.code();
+EventHandler::Snapshot EventHandler::snapshot() const {
+  return Snapshot{_keyState, (std::uint8_t)_semicolonMode};
+}
 
-    if (event->value == 1) {
-      _capslock.isPressed() = true;
-    } else if (event->value == 0) {
-      _capslock.isPressed() = false;
-    }
+void EventHandler::restore(Snapshot const& snapshot) {
+  _keyState = snapshot.keyState;
 
-    return true;
-  }
-
-  return false;
+  // A mode this build does not know of is dropped along with its rewrite
+  _semicolonMode = snapshot.semicolonMode <= (std::uint8_t)SemicolonMode::Backspace
+                     ? (SemicolonMode)snapshot.semicolonMode
+                     : SemicolonMode::None;
 }
 
-bool handleGermanShift(struct input_event* event) {
-  if (event->type == EV_KEY && event->code == _germanShift.code()) {
-    event->code = _leftShift.code();
-
-    if (event->value == 1) {
-      _germanShift.isPressed() = true;
-    } else if (event->value == 0) {
-      _germanShift.isPressed() = false;
-    }
+void EventHandler::sendChord(struct input_event const* event,
+                             Chord const& chord,
+                             FrameBuffer* frame) {
+  std::vector<struct input_event> const& encodedFrame
+    = event->value == 1 ? chord.press : event->value == 2 ? chord.repeat : chord.release;
 
-    return true;
+  for (struct input_event encodedEvent : encodedFrame) {
+    encodedEvent.time = event->time;
+    frame->push(encodedEvent);
   }
-
-  return false;
 }
 
-bool handleAlt(struct input_event* event) {
-  if (event->type != EV_KEY) {
-    return false;
-  }
-
-  if (event->code == _leftAlt.code()) {
-    if (event->value == 1) {
-      _leftAlt.isPressed() = true;
-    } else if (event->value == 0) {
-      _leftAlt.isPressed() = false;
-    }
+bool EventHandler::handleSemicolon(struct input_event* event, FrameBuffer* frame) {
+  SemicolonMode mode = _semicolonMode;
+  bool isConsumed = true;
 
-    if (_altSemicolon.isPressed()) {
-      _isEventHandled = true;
-    }
+  if (mode == SemicolonMode::None) {
+    if (_keyState.isAnyPressed(shiftMask)) {
+      mode = SemicolonMode::Shifted;
+    } else if (_keyState.isAnyPressed(altMask)) {
+      mode = SemicolonMode::Alt;
 
-    return true;
-  } else if (event->code == _rightAlt.code()) {
-    if (event->value == 1) {
-      _rightAlt.isPressed() = true;
-    } else if (event->value == 0) {
-      _rightAlt.isPressed() = false;
-    }
+      // Ctrl tapped in between keeps the Alt release from opening a menu
+      sendKeyEvent(frame, &event->time, 1, KEY_LEFTCTRL);
 
-    if (_altSemicolon.isPressed()) {
-      _isEventHandled = true;
-    }
+      if (_keyState.isPressed(TrackedKey::LeftAlt)) {
+        sendKeyEvent(frame, &event->time, 0, KEY_LEFTALT);
+      }
 
-    return true;
-  }
+      if (_keyState.isPressed(TrackedKey::RightAlt)) {
+        sendKeyEvent(frame, &event->time, 0, KEY_RIGHTALT);
+      }
 
-  return false;
-}
+      sendKeyEvent(frame, &event->time, 0, KEY_LEFTCTRL);
 
-bool handleCtrl(struct input_event* event) {
-  if (event->type != EV_KEY) {
-    return false;
-  }
+      if (_keyState.isPressed(TrackedKey::LeftCtrl)) {
+        sendKeyEvent(frame, &event->time, 1, KEY_LEFTCTRL);
+      }
 
-  if (event->code == _leftCtrl.code()) {
-    if (event->value == 1) {
-      _leftCtrl.isPressed() = true;
-    } else if (event->value == 0) {
-      _leftCtrl.isPressed() = false;
+      sendKeyEvent(frame, &event->time, event->value, event->code);
+    } else {
+      mode = SemicolonMode::Backspace;
     }
 
-    return true;
-  } else if (event->code == _rightCtrl.code()) {
-    if (event->value == 1) {
-      _rightCtrl.isPressed() = true;
-    } else if (event->value == 0) {
-      _rightCtrl.isPressed() = false;
+    if (mode != SemicolonMode::Alt) {
+      isConsumed = false;
     }
-
-    return true;
+  } else if (mode == SemicolonMode::Shifted) {
+    if (_keyState.isAnyPressed(shiftMask)) {
+      isConsumed = false;
+    } else {
+      sendKeyEvent(frame, &event->time, 1, KEY_LEFTSHIFT);
+      sendKeyEvent(frame, &event->time, event->value, event->code);
+      sendKeyEvent(frame, &event->time, 0, KEY_LEFTSHIFT);
+    }
+  } else if (mode == SemicolonMode::Alt) {
+    sendKeyEvent(frame, &event->time, event->value, event->code);
+  } else {
+    isConsumed = false;
   }
 
-  return false;
-}
-
-bool handleShift(struct input_event* event) {
-  if (event->type != EV_KEY) {
-    return false;
+  if (mode == SemicolonMode::Backspace) {
+    event->code = KEY_BACKSPACE;
   }
 
-  if (event->code == _leftShift.code()) {
-    if (event->value == 1) {
-      _leftShift.isPressed() = true;
-    } else if (event->value == 0) {
-      _leftShift.isPressed() = false;
-    }
-
-    return true;
-  } else if (event->code == _rightShift.code()) {
-    if (event->value == 1) {
-      _rightShift.isPressed() = true;
-    } else if (event->value == 0) {
-      _rightShift.isPressed() = false;
-    }
-
-    return true;
+  if (event->value == 1) {
+    _semicolonMode = mode;
+  } else if (event->value == 0) {
+    _semicolonMode = SemicolonMode::None;
   }
 
-  return false;
+  return isConsumed;
 }
 
-bool handleSemicolon(struct input_event* event) {
-  if (event->type != EV_KEY || event->code != _semicolon.code()) {
+bool EventHandler::handleEvent(struct input_event* event, FrameBuffer* frame) {
+  if (event->type != EV_KEY || event->code >= KEY_CNT) {
     return false;
   }
 
-  if (_semicolon.isPressed()) {
-    if (!isShiftPressed()) {
-      _leftShift.press(&event->time);
-
-      sendKeyEvent(&event->time, event->value, event->code);
-      _leftShift.release(&event->time);
-    }
-
-    if (event->value == 1) {
-      _semicolon.isPressed() = true;
-    } else if (event->value == 0) {
-      _semicolon.isPressed() = false;
-    }
-
-    return true;
-  }
-
-  if (_altSemicolon.isPressed()) {
-    sendKeyEvent(&event->time, event->value, event->code);
-
-    if (event->value == 1) {
-      _altSemicolon.isPressed() = true;
-    } else if (event->value == 0) {
-      _altSemicolon.isPressed() = false;
-
-      // if (_leftAlt.isPressed()) {
-      //  _semicolonLeftAlt.restoreState(&event->time);
-      // }
+  KeyAction const& action = (*_keymap)[event->code];
 
-      // if (_rightAlt.isPressed()) {
-      //  _semicolonRightAlt.restoreState(&event->time);
-      // }
-    }
-
-    return true;
+  if (event->value != 2) {
+    _keyState.update(event->code, action.trackedKey, event->value != 0);
   }
 
-  if (_fakeBackspace.isPressed()) {
-    if (event->value == 1) {
-      _fakeBackspace.isPressed() = true;
-    } else if (event->value == 0) {
-      _fakeBackspace.isPressed() = false;
-    }
-
-    event->code = _fakeBackspace.code();
-
-    return true;
-  }
+  switch (action.action) {
+  case Action::Remap:
+    event->code = action.code;
 
-  if (isShiftPressed()) {
-    if (event->value == 1) {
-      _semicolon.isPressed() = true;
-    } else if (event->value == 0) {
-      _semicolon.isPressed() = false;
+    // Alt is held back while the ";" it turned into is pressed
+    if ((modifierMask(action.trackedKey) & altMask) != 0
+        && _semicolonMode == SemicolonMode::Alt) {
+      return true;
     }
 
-    //
-  } else if (isAltPressed()) {
-    _semicolonLeftCtrl.isPressed() = _leftCtrl.isPressed();
-    _semicolonLeftCtrl.saveState();
-    _semicolonLeftCtrl.isPressed() = false;
-    _semicolonLeftCtrl.press(&event->time);
-
-    _semicolonLeftAlt.isPressed() = _leftAlt.isPressed();
-    _semicolonRightAlt.isPressed() = _rightAlt.isPressed();
-    _semicolonLeftAlt.saveState();
-    _semicolonLeftAlt.release(&event->time);
-    _semicolonRightAlt.saveState();
-    _semicolonRightAlt.release(&event->time);
-
-    _semicolonLeftCtrl.release(&event->time);
-    _semicolonLeftCtrl.restoreState(&event->time);
-
-    sendKeyEvent(&event->time, event->value, event->code);
-
-    // _leftAlt.restoreState(&event->time);
-    // _rightAlt.restoreState(&event->time);
-
-    if (event->value == 1) {
-      _altSemicolon.isPressed() = true;
-    } else if (event->value == 0) {
-      _altSemicolon.isPressed() = false;
-    }
-  } else {
-    event->code = _fakeBackspace.code();
-
-    if (event->value == 1) {
-      _fakeBackspace.isPressed() = true;
-    } else if (event->value == 0) {
-      _fakeBackspace.isPressed() = false;
-    }
-  }
-
-  return true;
-}
+    return false;
 
-static bool handleSysRqToLeftMeta(input_event* event) {
-  if (event->type == EV_KEY && event->code == _sysRq.code()) {
-    event->code = _leftMeta.code();
+  case Action::Semicolon:
+    return handleSemicolon(event, frame);
 
-    if (event->value == 1) {
-      _sysRq.isPressed() = true;
-    } else if (event->value == 0) {
-      _sysRq.isPressed() = false;
-    }
+  case Action::Chord:
+    sendChord(event, _keymap->chord(action.code), frame);
 
     return true;
-  }
-
-  return false;
-}
-
-static bool handleComposeToLeftMeta(input_event* event) {
-  if (event->type == EV_KEY && event->code == _compose.code()) {
-    event->code = _leftMeta.code();
-
-    if (event->value == 1) {
-      _compose.isPressed() = true;
-    } else if (event->value == 0) {
-      _compose.isPressed() = false;
-    }
 
+  case Action::Drop:
     return true;
   }
 
   return false;
 }
-
-static bool handleFnToLeftMeta(input_event* event) {
-  (void)event;
-  // if (event->type == EV_KEY &&
-  //     event->code == _sysRq.code()) {
-  //   event->code = _leftMeta.code();
-
-  //   if (event->value == 1) {
-  //     _sysRq.isPressed() = true;
-  //   } else if (event->value == 0) {
-  //     _sysRq.isPressed() = false;
-  //   }
-
-  //   return true;
-  // }
-
-  return false;
-}
-
-void handleEvent(struct input_event* event, bool useFnAsWindowKey) {
-  if (handleCapsLock(event)) {
-    //
-  } else if (handleGermanShift(event)) {
-    //
-  } else if (handleShift(event)) {
-    //
-  } else if (handleAlt(event)) {
-    //
-  } else if (handleCtrl(event)) {
-    //
-// } else if (handleSemicolon(event)) {
-    //
-  } else if (handleComposeToLeftMeta(event)) {
-    //
-  } else if (handleSysRqToLeftMeta(event)) {
-    //
-  } else if (useFnAsWindowKey && handleFnToLeftMeta(event)) {
-    //
-  } else {
-    //
-  }
-}
+} // namespace Reader
+} // namespace KeyboardHook
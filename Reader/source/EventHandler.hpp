@@ -1,11 +1,103 @@
 #pragma once
 
 #include <linux/input.h>
-#include <vector>
 
-typedef std::vector<struct input_event> EventQueue;
+#include <cstddef>
+#include <cstdint>
+#include <memory>
 
-extern EventQueue _eventQueue;
-extern bool _isEventHandled;
+#include "FrameBuffer.hpp"
+#include "KeyState.hpp"
+#include "Keymap.hpp"
 
-void handleEvent(struct input_event* event, bool useFnAsWindowKey);
+namespace KeyboardHook {
+namespace Reader {
+// Remapping state of a single input device
+class EventHandler {
+public:
+  // State that goes along with the device when it is handed over to another
+  // process
+  struct Snapshot {
+    KeyState keyState;
+    std::uint8_t semicolonMode;
+  };
+
+  // Most events a single event is replaced with, the Alt-; rewrite sends six
+  // keys as frames of three events
+  static std::size_t const maxEventsPerEvent = 18;
+
+  EventHandler();
+
+  void setKeymap(std::shared_ptr<Keymap const> keymap) { _keymap = std::move(keymap); }
+
+  std::shared_ptr<Keymap const> const& keymap() const { return _keymap; }
+
+  // Returns true if the event is consumed, the events sent instead (if any) are
+  // appended to the frame. Otherwise the (possibly modified) event is to be
+  // forwarded as is.
+  bool handleEvent(struct input_event* event, FrameBuffer* frame);
+
+  // Physical state of the keys, as last reported by the device
+  KeyState const& keyState() const { return _keyState; }
+
+  Snapshot snapshot() const;
+
+  void restore(Snapshot const& snapshot);
+
+private:
+  // How the key press of ";" was rewritten, its repeats and release follow it
+  enum class SemicolonMode : std::uint8_t {
+    None,
+    Shifted,
+    Alt,
+    Backspace,
+  };
+
+  bool handleSemicolon(struct input_event* event, FrameBuffer* frame);
+
+  void sendChord(struct input_event const* event, Chord const& chord, FrameBuffer* frame);
+
+  std::shared_ptr<Keymap const> _keymap;
+  KeyState _keyState;
+  SemicolonMode _semicolonMode;
+};
+
+// Passes the event through the handler into the frame the way a device
+// forwards it. A frame too long for the buffer is flushed in parts before an
+// event, rather than truncated, and a frame is complete only with its
+// SYN_REPORT, which flushes it. flush() takes the events out of the frame and
+// returns 0, or an error that is returned right away. isRemapped (if not
+// NULL) tells whether the handler consumed or changed the event.
+template <typename Flush>
+int forwardEvent(EventHandler* handler,
+                 FrameBuffer* frame,
+                 struct input_event* event,
+                 Flush const& flush,
+                 bool* isRemapped = NULL) {
+  if (frame->available() <= EventHandler::maxEventsPerEvent) {
+    int result = flush();
+
+    if (result != 0) {
+      return result;
+    }
+  }
+
+  __u16 const code = event->code;
+  bool const isConsumed = handler->handleEvent(event, frame);
+
+  if (!isConsumed) {
+    frame->push(*event);
+  }
+
+  if (isRemapped != NULL) {
+    *isRemapped = isConsumed || event->code != code;
+  }
+
+  if (event->type == EV_SYN && event->code == SYN_REPORT) {
+    return flush();
+  }
+
+  return 0;
+}
+} // namespace Reader
+} // namespace KeyboardHook
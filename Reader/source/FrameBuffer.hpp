@@ -0,0 +1,51 @@
+#pragma once
+
+#include <linux/input.h>
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+namespace KeyboardHook {
+namespace Reader {
+// Events of the frame being sent, stored inline so that the event path never
+// allocates and a pushed event never moves. Events pushed to a full buffer are
+// dropped and counted instead of growing it.
+class FrameBuffer {
+public:
+  static std::size_t const capacity = 128;
+
+  FrameBuffer() : _size(0), _overflowCount(0) {}
+
+  bool push(struct input_event const& event) {
+    if (_size == capacity) {
+      ++_overflowCount;
+
+      return false;
+    }
+
+    _events[_size++] = event;
+
+    return true;
+  }
+
+  void clear() { _size = 0; }
+
+  bool empty() const { return _size == 0; }
+
+  std::size_t size() const { return _size; }
+
+  std::size_t available() const { return capacity - _size; }
+
+  struct input_event const* data() const { return _events.data(); }
+
+  // Events dropped because the buffer was full
+  std::uint64_t overflowCount() const { return _overflowCount; }
+
+private:
+  std::array<struct input_event, capacity> _events;
+  std::size_t _size;
+  std::uint64_t _overflowCount;
+};
+} // namespace Reader
+} // namespace KeyboardHook
@@ -0,0 +1,406 @@
+#include "IoRing.hpp"
+
+#include <poll.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <vector>
+
+#include "log.hpp"
+
+namespace KeyboardHook {
+namespace Reader {
+// Group of the buffers reads pick from, the ring has one
+static std::uint16_t const bufferGroup = 0;
+
+static void* mapMemory(std::size_t size) {
+  void* memory = mmap(NULL,
+                      size,
+                      PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE,
+                      -1,
+                      0);
+
+  return memory == MAP_FAILED ? NULL : memory;
+}
+
+// Entries of the buffer ring. The headers declare them as a flexible array,
+// which C++ places after an empty member instead of at the start.
+static struct io_uring_buf*
+bufferEntry(struct io_uring_buf_ring* ring, std::uint32_t index) {
+  return reinterpret_cast<struct io_uring_buf*>(ring) + index;
+}
+
+static bool isSupported(int fileDescriptor, unsigned operation) {
+  // Room for every operation the kernel may know, newer than these headers
+  unsigned const operationCount = 256;
+  std::size_t const size
+    = sizeof(struct io_uring_probe) + operationCount * sizeof(struct io_uring_probe_op);
+  std::vector<unsigned char> memory(size);
+  struct io_uring_probe* probe = reinterpret_cast<struct io_uring_probe*>(memory.data());
+
+  if (syscall(__NR_io_uring_register,
+              fileDescriptor,
+              IORING_REGISTER_PROBE,
+              probe,
+              operationCount)
+      != 0) {
+    return false;
+  }
+
+  return operation <= probe->last_op
+         && (probe->ops[operation].flags & IO_URING_OP_SUPPORTED) != 0;
+}
+
+IoRing::IoRing()
+  : _fileDescriptor(-1),
+    _rings(NULL),
+    _ringsSize(0),
+    _entries(NULL),
+    _entriesSize(0),
+    _entryMask(0),
+    _entryCount(0),
+    _submissionHead(NULL),
+    _submissionTail(NULL),
+    _submissionArray(NULL),
+    _queuedTail(0),
+    _completionHead(NULL),
+    _completionTail(NULL),
+    _completionMask(0),
+    _completions(NULL),
+    _bufferRing(NULL),
+    _bufferRingSize(0),
+    _buffers(NULL),
+    _bufferCount(0),
+    _bufferSize(0) {}
+
+IoRing::~IoRing() {
+  destroy();
+}
+
+void IoRing::destroy() {
+  // Closing the ring cancels whatever runs on it
+  if (_fileDescriptor >= 0) {
+    close(_fileDescriptor);
+    _fileDescriptor = -1;
+  }
+
+  if (_entries != NULL) {
+    munmap(_entries, _entriesSize);
+    _entries = NULL;
+  }
+
+  if (_rings != NULL) {
+    munmap(_rings, _ringsSize);
+    _rings = NULL;
+  }
+
+  if (_bufferRing != NULL) {
+    munmap(_bufferRing, _bufferRingSize);
+    _bufferRing = NULL;
+  }
+
+  if (_buffers != NULL) {
+    munmap(_buffers, (std::size_t)_bufferCount * _bufferSize);
+    _buffers = NULL;
+  }
+}
+
+bool IoRing::create(unsigned entries, unsigned bufferCount, unsigned bufferSize) {
+  struct io_uring_params params;
+
+  memset(&params, 0, sizeof(params));
+
+  _fileDescriptor = syscall(__NR_io_uring_setup, entries, &params);
+
+  if (_fileDescriptor < 0) {
+    logError("Failed to set up io_uring: %s", strerror(errno));
+
+    return false;
+  }
+
+  if ((params.features & IORING_FEAT_SINGLE_MMAP) == 0
+      || (params.features & IORING_FEAT_NODROP) == 0
+      || !isSupported(_fileDescriptor, IORING_OP_READ_MULTISHOT)) {
+    logError("The io_uring of this kernel does not support multishot reads");
+
+    destroy();
+
+    return false;
+  }
+
+  // The submission and completion rings share a single mapping
+  _ringsSize
+    = std::max(params.sq_off.array + params.sq_entries * sizeof(std::uint32_t),
+               params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe));
+  _rings = mmap(NULL,
+                _ringsSize,
+                PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE,
+                _fileDescriptor,
+                IORING_OFF_SQ_RING);
+
+  if (_rings == MAP_FAILED) {
+    _rings = NULL;
+  }
+
+  _entriesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+  _entries = static_cast<struct io_uring_sqe*>(mmap(NULL,
+                                                    _entriesSize,
+                                                    PROT_READ | PROT_WRITE,
+                                                    MAP_SHARED | MAP_POPULATE,
+                                                    _fileDescriptor,
+                                                    IORING_OFF_SQES));
+
+  if (_entries == MAP_FAILED) {
+    _entries = NULL;
+  }
+
+  if (_rings == NULL || _entries == NULL) {
+    logError("Failed to map the io_uring: %s", strerror(errno));
+
+    destroy();
+
+    return false;
+  }
+
+  unsigned char* rings = static_cast<unsigned char*>(_rings);
+
+  _submissionHead = reinterpret_cast<std::uint32_t*>(rings + params.sq_off.head);
+  _submissionTail = reinterpret_cast<std::uint32_t*>(rings + params.sq_off.tail);
+  _submissionArray = reinterpret_cast<std::uint32_t*>(rings + params.sq_off.array);
+  _entryMask = *reinterpret_cast<std::uint32_t*>(rings + params.sq_off.ring_mask);
+  _entryCount = params.sq_entries;
+  _queuedTail = *_submissionTail;
+  _completionHead = reinterpret_cast<std::uint32_t*>(rings + params.cq_off.head);
+  _completionTail = reinterpret_cast<std::uint32_t*>(rings + params.cq_off.tail);
+  _completionMask = *reinterpret_cast<std::uint32_t*>(rings + params.cq_off.ring_mask);
+  _completions = reinterpret_cast<struct io_uring_cqe*>(rings + params.cq_off.cqes);
+
+  // The kernel reads straight into these, nothing is copied on the way
+  _bufferCount = bufferCount;
+  _bufferSize = bufferSize;
+  _bufferRingSize = bufferCount * sizeof(struct io_uring_buf);
+  _bufferRing = static_cast<struct io_uring_buf_ring*>(mapMemory(_bufferRingSize));
+  _buffers
+    = static_cast<unsigned char*>(mapMemory((std::size_t)bufferCount * bufferSize));
+
+  if (_bufferRing == NULL || _buffers == NULL) {
+    logError("Failed to allocate the io_uring buffers: %s", strerror(errno));
+
+    destroy();
+
+    return false;
+  }
+
+  struct io_uring_buf_reg registration;
+
+  memset(&registration, 0, sizeof(registration));
+  registration.ring_addr = (std::uint64_t)(std::uintptr_t)_bufferRing;
+  registration.ring_entries = bufferCount;
+  registration.bgid = bufferGroup;
+
+  if (syscall(__NR_io_uring_register,
+              _fileDescriptor,
+              IORING_REGISTER_PBUF_RING,
+              &registration,
+              1)
+      != 0) {
+    logError("Failed to register the io_uring buffers: %s", strerror(errno));
+
+    destroy();
+
+    return false;
+  }
+
+  for (std::uint32_t i = 0; i < bufferCount; ++i) {
+    struct io_uring_buf* buffer = bufferEntry(_bufferRing, i);
+
+    buffer->addr
+      = (std::uint64_t)(std::uintptr_t)(_buffers + (std::size_t)i * bufferSize);
+    buffer->len = bufferSize;
+    buffer->bid = (std::uint16_t)i;
+  }
+
+  __atomic_store_n(&_bufferRing->tail, (std::uint16_t)bufferCount, __ATOMIC_RELEASE);
+
+  return true;
+}
+
+bool IoRing::isFull() const {
+  return _queuedTail - __atomic_load_n(_submissionHead, __ATOMIC_ACQUIRE) == _entryCount;
+}
+
+struct io_uring_sqe* IoRing::nextEntry() {
+  // A full ring is submitted to make room
+  if (isFull() && (enter(0) < 0 || isFull())) {
+    return NULL;
+  }
+
+  std::uint32_t const index = _queuedTail & _entryMask;
+  struct io_uring_sqe* entry = &_entries[index];
+
+  memset(entry, 0, sizeof(*entry));
+  _submissionArray[index] = index;
+  ++_queuedTail;
+
+  return entry;
+}
+
+bool IoRing::read(int fileDescriptor, std::uint64_t data) {
+  struct io_uring_sqe* entry = nextEntry();
+
+  if (entry == NULL) {
+    return false;
+  }
+
+  // Each read takes a whole buffer
+  entry->opcode = IORING_OP_READ_MULTISHOT;
+  entry->fd = fileDescriptor;
+  entry->flags = IOSQE_BUFFER_SELECT;
+  entry->buf_group = bufferGroup;
+  entry->user_data = data;
+
+  return true;
+}
+
+bool IoRing::write(int fileDescriptor,
+                   void const* buffer,
+                   unsigned size,
+                   std::uint64_t data) {
+  struct io_uring_sqe* entry = nextEntry();
+
+  if (entry == NULL) {
+    return false;
+  }
+
+  entry->opcode = IORING_OP_WRITE;
+  entry->fd = fileDescriptor;
+  entry->addr = (std::uint64_t)(std::uintptr_t)buffer;
+  entry->len = size;
+  entry->user_data = data;
+
+  return true;
+}
+
+bool IoRing::poll(int fileDescriptor, std::uint64_t data) {
+  struct io_uring_sqe* entry = nextEntry();
+
+  if (entry == NULL) {
+    return false;
+  }
+
+  entry->opcode = IORING_OP_POLL_ADD;
+  entry->fd = fileDescriptor;
+  entry->poll32_events = POLLIN;
+  entry->user_data = data;
+
+  return true;
+}
+
+bool IoRing::cancel(int fileDescriptor) {
+  // Only what was submitted can be cancelled
+  if (enter(0) < 0) {
+    return false;
+  }
+
+  struct io_uring_sync_cancel_reg registration;
+
+  memset(&registration, 0, sizeof(registration));
+  registration.fd = fileDescriptor;
+  registration.flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+  registration.timeout.tv_sec = -1;
+  registration.timeout.tv_nsec = -1;
+
+  if (syscall(__NR_io_uring_register,
+              _fileDescriptor,
+              IORING_REGISTER_SYNC_CANCEL,
+              &registration,
+              1)
+        < 0
+      && errno != ENOENT) {
+    logError("Failed to cancel the io_uring reads of %d: %s",
+             fileDescriptor,
+             strerror(errno));
+
+    return false;
+  }
+
+  return true;
+}
+
+int IoRing::enter(unsigned waitCount) {
+  __atomic_store_n(_submissionTail, _queuedTail, __ATOMIC_RELEASE);
+
+  std::uint32_t const submitCount
+    = _queuedTail - __atomic_load_n(_submissionHead, __ATOMIC_ACQUIRE);
+
+  if (submitCount == 0 && waitCount == 0) {
+    return 0;
+  }
+
+  int result = syscall(__NR_io_uring_enter,
+                       _fileDescriptor,
+                       submitCount,
+                       waitCount,
+                       waitCount > 0 ? IORING_ENTER_GETEVENTS : 0,
+                       NULL,
+                       0);
+
+  return result < 0 ? -errno : result;
+}
+
+bool IoRing::isCompleted() const {
+  return *_completionHead != __atomic_load_n(_completionTail, __ATOMIC_ACQUIRE);
+}
+
+bool IoRing::complete(Completion* completion) {
+  std::uint32_t const head = *_completionHead;
+
+  if (head == __atomic_load_n(_completionTail, __ATOMIC_ACQUIRE)) {
+    return false;
+  }
+
+  struct io_uring_cqe const& entry = _completions[head & _completionMask];
+
+  completion->data = entry.user_data;
+  completion->result = entry.res;
+  completion->flags = entry.flags;
+
+  __atomic_store_n(_completionHead, head + 1, __ATOMIC_RELEASE);
+
+  return true;
+}
+
+void* IoRing::buffer(Completion const& completion) const {
+  if ((completion.flags & IORING_CQE_F_BUFFER) == 0) {
+    return NULL;
+  }
+
+  std::uint16_t const id = completion.flags >> IORING_CQE_BUFFER_SHIFT;
+
+  return _buffers + (std::size_t)id * _bufferSize;
+}
+
+void IoRing::recycle(Completion const& completion) {
+  if ((completion.flags & IORING_CQE_F_BUFFER) == 0) {
+    return;
+  }
+
+  std::uint16_t const id = completion.flags >> IORING_CQE_BUFFER_SHIFT;
+  std::uint16_t const tail = _bufferRing->tail;
+  struct io_uring_buf* buffer = bufferEntry(_bufferRing, tail & (_bufferCount - 1));
+
+  buffer->addr
+    = (std::uint64_t)(std::uintptr_t)(_buffers + (std::size_t)id * _bufferSize);
+  buffer->len = _bufferSize;
+  buffer->bid = id;
+
+  __atomic_store_n(&_bufferRing->tail, (std::uint16_t)(tail + 1), __ATOMIC_RELEASE);
+}
+} // namespace Reader
+} // namespace KeyboardHook
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <linux/io_uring.h>
+
+#include <cstddef>
+#include <cstdint>
+
+namespace KeyboardHook {
+namespace Reader {
+// An io_uring along with a ring of buffers the kernel picks from for the reads
+// it completes, set up through the system calls alone
+class IoRing {
+public:
+  struct Completion {
+    std::uint64_t data;
+    std::int32_t result;
+    std::uint32_t flags;
+  };
+
+  IoRing();
+
+  IoRing(IoRing const&) = delete;
+
+  ~IoRing();
+
+  IoRing& operator=(IoRing const&) = delete;
+
+  // Sets up entries submissions and bufferCount buffers of bufferSize bytes
+  // (both powers of two), returns false if the kernel does not support it
+  bool create(unsigned entries, unsigned bufferCount, unsigned bufferSize);
+
+  bool isCreated() const { return _fileDescriptor >= 0; }
+
+  // Keeps reading the descriptor into the buffers until it fails or runs out
+  // of buffers, every read completes on its own
+  bool read(int fileDescriptor, std::uint64_t data);
+
+  // The buffer stays in use until its write completes
+  bool write(int fileDescriptor, void const* buffer, unsigned size, std::uint64_t data);
+
+  // Completes once the descriptor is readable
+  bool poll(int fileDescriptor, std::uint64_t data);
+
+  // Cancels everything running on the descriptor before returning, their
+  // completions follow
+  bool cancel(int fileDescriptor);
+
+  // Submits everything queued and waits for waitCount completions, returns a
+  // negative errno on failure
+  int enter(unsigned waitCount);
+
+  // True if a completion is waiting, without a system call
+  bool isCompleted() const;
+
+  // Takes the next completion without a system call, returns false if there is
+  // none
+  bool complete(Completion* completion);
+
+  // Buffer the read of the completion went to, NULL if it has none
+  void* buffer(Completion const& completion) const;
+
+  // Gives the buffer of the completion back to the kernel
+  void recycle(Completion const& completion);
+
+private:
+  void destroy();
+
+  bool isFull() const;
+
+  struct io_uring_sqe* nextEntry();
+
+  int _fileDescriptor;
+  void* _rings;
+  std::size_t _ringsSize;
+  struct io_uring_sqe* _entries;
+  std::size_t _entriesSize;
+  std::uint32_t _entryMask;
+  std::uint32_t _entryCount;
+  std::uint32_t* _submissionHead;
+  std::uint32_t* _submissionTail;
+  std::uint32_t* _submissionArray;
+  std::uint32_t _queuedTail;
+  std::uint32_t* _completionHead;
+  std::uint32_t* _completionTail;
+  std::uint32_t _completionMask;
+  struct io_uring_cqe* _completions;
+  struct io_uring_buf_ring* _bufferRing;
+  std::size_t _bufferRingSize;
+  unsigned char* _buffers;
+  std::uint32_t _bufferCount;
+  std::uint32_t _bufferSize;
+};
+} // namespace Reader
+} // namespace KeyboardHook
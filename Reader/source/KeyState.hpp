@@ -0,0 +1,81 @@
+#pragma once
+
+#include <linux/input.h>
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+#include "Keymap.hpp"
+
+namespace KeyboardHook {
+namespace Reader {
+constexpr std::uint32_t modifierMask(TrackedKey trackedKey) {
+  return trackedKey == TrackedKey::None ? 0 : 1u << (unsigned)trackedKey;
+}
+
+std::uint32_t const shiftMask = modifierMask(TrackedKey::LeftShift)
+                                | modifierMask(TrackedKey::RightShift)
+                                | modifierMask(TrackedKey::GermanShift);
+
+std::uint32_t const altMask
+  = modifierMask(TrackedKey::LeftAlt) | modifierMask(TrackedKey::RightAlt);
+
+std::uint32_t const ctrlMask
+  = modifierMask(TrackedKey::LeftCtrl) | modifierMask(TrackedKey::RightCtrl);
+
+// Pressed state of every key of a device, a bit per key code. The tracked
+// modifiers also have a bit each in a single word, so that testing for any
+// Shift or Alt is one and.
+class KeyState {
+public:
+  typedef std::uint64_t Word;
+
+  static std::size_t const wordBits = 64;
+
+  static std::size_t const wordCount = (KEY_CNT + wordBits - 1) / wordBits;
+
+  KeyState() : _keys(), _modifiers(0) {}
+
+  bool isPressed(KeyCode code) const {
+    return (_keys[code / wordBits] >> (code % wordBits)) & 1;
+  }
+
+  bool isPressed(TrackedKey trackedKey) const {
+    return (_modifiers & modifierMask(trackedKey)) != 0;
+  }
+
+  bool isAnyPressed(std::uint32_t mask) const { return (_modifiers & mask) != 0; }
+
+  bool isAnyKeyPressed() const {
+    Word pressed = 0;
+
+    for (Word word : _keys) {
+      pressed |= word;
+    }
+
+    return pressed != 0;
+  }
+
+  void update(KeyCode code, TrackedKey trackedKey, bool isPressed) {
+    Word const bit = Word(1) << (code % wordBits);
+
+    if (isPressed) {
+      _keys[code / wordBits] |= bit;
+      _modifiers |= modifierMask(trackedKey);
+    } else {
+      _keys[code / wordBits] &= ~bit;
+      _modifiers &= ~modifierMask(trackedKey);
+    }
+  }
+
+  std::array<Word, wordCount> const& keys() const { return _keys; }
+
+  std::uint32_t modifiers() const { return _modifiers; }
+
+private:
+  std::array<Word, wordCount> _keys;
+  std::uint32_t _modifiers;
+};
+} // namespace Reader
+} // namespace KeyboardHook
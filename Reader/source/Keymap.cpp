@@ -0,0 +1,93 @@
+#include "Keymap.hpp"
+
+#include <algorithm>
+
+namespace KeyboardHook {
+namespace Reader {
+static struct input_event encodeEvent(__u16 type, __u16 code, __s32 value) {
+  struct input_event event = {};
+
+  event.type = type;
+  event.code = code;
+  event.value = value;
+
+  return event;
+}
+
+Keymap::Keymap() {
+  for (KeyCode code = 0; code < KEY_CNT; ++code) {
+    _actions[code].action = Action::Remap;
+    _actions[code].trackedKey = TrackedKey::None;
+    _actions[code].code = code;
+  }
+}
+
+void Keymap::remap(KeyCode code, KeyCode target) {
+  _actions[code].action = Action::Remap;
+  _actions[code].code = target;
+}
+
+void Keymap::bind(KeyCode code, Action action) {
+  _actions[code].action = action;
+  _actions[code].code = code;
+}
+
+void Keymap::bindChord(KeyCode code, std::vector<KeyCode> const& keys) {
+  Chord chord;
+
+  for (KeyCode key : keys) {
+    chord.press.push_back(encodeEvent(EV_KEY, key, 1));
+  }
+
+  chord.press.push_back(encodeEvent(EV_SYN, SYN_REPORT, 0));
+
+  chord.repeat.push_back(encodeEvent(EV_KEY, keys.back(), 2));
+  chord.repeat.push_back(encodeEvent(EV_SYN, SYN_REPORT, 0));
+
+  for (auto key = keys.rbegin(); key != keys.rend(); ++key) {
+    chord.release.push_back(encodeEvent(EV_KEY, *key, 0));
+  }
+
+  chord.release.push_back(encodeEvent(EV_SYN, SYN_REPORT, 0));
+
+  _actions[code].action = Action::Chord;
+  _actions[code].code = _chords.size();
+
+  _chords.push_back(chord);
+}
+
+void Keymap::track(KeyCode code, TrackedKey trackedKey) {
+  _actions[code].trackedKey = trackedKey;
+}
+
+bool Keymap::isPlainRemap() const {
+  return std::all_of(_actions.begin(), _actions.end(), [](KeyAction const& action) {
+    return action.action == Action::Remap || action.action == Action::Drop;
+  });
+}
+
+TrackedKey trackedKeyOf(KeyCode code, KeyCode target) {
+  switch (target) {
+  case KEY_LEFTSHIFT:
+    return code == KEY_LEFTSHIFT ? TrackedKey::LeftShift : TrackedKey::GermanShift;
+
+  case KEY_RIGHTSHIFT:
+    return TrackedKey::RightShift;
+
+  case KEY_LEFTALT:
+    return TrackedKey::LeftAlt;
+
+  case KEY_RIGHTALT:
+    return TrackedKey::RightAlt;
+
+  case KEY_LEFTCTRL:
+    return TrackedKey::LeftCtrl;
+
+  case KEY_RIGHTCTRL:
+    return TrackedKey::RightCtrl;
+  }
+
+  return TrackedKey::None;
+}
+} // namespace Reader
+} // namespace KeyboardHook
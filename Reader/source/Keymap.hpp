@@ -0,0 +1,81 @@
+#pragma once
+
+#include <linux/input.h>
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace KeyboardHook {
+namespace Reader {
+typedef unsigned int KeyCode;
+
+// What the remapping does with a key event
+enum class Action : std::uint8_t {
+  Remap,     // sends the event with the key code of the entry
+  Semicolon, // ";" becomes backspace and "Alt-;" becomes ";"
+  Chord,     // sends the pre-encoded frames of the chord the entry refers to
+  Drop,      // sends nothing
+};
+
+// Keys whose state the remapping depends on
+enum class TrackedKey : std::uint8_t {
+  None,
+  LeftShift,
+  RightShift,
+  GermanShift, // any other key sending left Shift, the 102nd key by default
+  LeftAlt,
+  RightAlt,
+  LeftCtrl,
+  RightCtrl,
+  Count,
+};
+
+struct KeyAction {
+  Action action;
+  TrackedKey trackedKey;
+  std::uint16_t code;
+};
+
+// Output frames of a chord, encoded when the keymap is compiled. Only the
+// time is filled in when they are sent.
+struct Chord {
+  std::vector<struct input_event> press;
+  std::vector<struct input_event> repeat;
+  std::vector<struct input_event> release;
+};
+
+// Action of every key code of a device, dispatching an event is a single
+// lookup however many keys are remapped
+class Keymap {
+public:
+  // Sends every key as is
+  Keymap();
+
+  KeyAction const& operator[](KeyCode code) const { return _actions[code]; }
+
+  Chord const& chord(std::uint16_t index) const { return _chords[index]; }
+
+  void remap(KeyCode code, KeyCode target);
+
+  void bind(KeyCode code, Action action);
+
+  // Pressing the key presses all the keys in order, releasing it releases
+  // them in reverse
+  void bindChord(KeyCode code, std::vector<KeyCode> const& keys);
+
+  void track(KeyCode code, TrackedKey trackedKey);
+
+  // Only remaps or drops keys, which the writer module can do by itself
+  bool isPlainRemap() const;
+
+private:
+  std::array<KeyAction, KEY_CNT> _actions;
+  std::vector<Chord> _chords;
+};
+
+// Modifier tracked for a key that sends the target code
+TrackedKey trackedKeyOf(KeyCode code, KeyCode target);
+} // namespace Reader
+} // namespace KeyboardHook
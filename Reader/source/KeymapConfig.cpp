@@ -0,0 +1,320 @@
+#include "KeymapConfig.hpp"
+
+#include <libevdev-1.0/libevdev/libevdev.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+
+#include "log.hpp"
+
+namespace KeyboardHook {
+namespace Reader {
+static std::size_t const maxChordKeys = 8;
+
+char const* const KeymapConfig::defaultConfig = "[keyboard]\n"
+                                                "CAPSLOCK = ESC\n"
+                                                "102ND = LEFTSHIFT\n"
+                                                "COMPOSE = LEFTMETA\n"
+                                                "SYSRQ = LEFTMETA\n";
+
+static std::string trim(std::string const& value) {
+  std::size_t begin = value.find_first_not_of(" \t\r");
+
+  if (begin == std::string::npos) {
+    return std::string();
+  }
+
+  return value.substr(begin, value.find_last_not_of(" \t\r") - begin + 1);
+}
+
+static bool parseNumber(std::string const& value, int* number) {
+  char* end = NULL;
+
+  if (value.empty()) {
+    return false;
+  }
+
+  long result = std::strtol(value.c_str(), &end, 0);
+
+  if (*end != '\0' || result < 0 || result > 0xffff) {
+    return false;
+  }
+
+  *number = result;
+
+  return true;
+}
+
+// Raw codes are told from key names by their "0x" prefix, so that the digit
+// keys are named as they are. "#" would start a comment.
+static bool parseRawKeyCode(std::string const& name, KeyCode* code) {
+  if (name.size() < 3 || name[0] != '0' || (name[1] != 'x' && name[1] != 'X')
+      || !std::isxdigit((unsigned char)name[2])) {
+    return false;
+  }
+
+  char* end = NULL;
+  long result = std::strtol(name.c_str() + 2, &end, 16);
+
+  if (*end != '\0' || result < 0 || result >= KEY_CNT) {
+    return false;
+  }
+
+  *code = result;
+
+  return true;
+}
+
+static bool parseKeyCode(std::string const& name, KeyCode* code) {
+  std::string upperName(name);
+
+  std::transform(upperName.begin(), upperName.end(), upperName.begin(), [](char c) {
+    return std::toupper((unsigned char)c);
+  });
+
+  if (upperName.compare(0, 4, "KEY_") != 0 && upperName.compare(0, 4, "BTN_") != 0) {
+    upperName = "KEY_" + upperName;
+  }
+
+  int result = libevdev_event_code_from_name(EV_KEY, upperName.c_str());
+
+  if (result >= 0) {
+    *code = result;
+
+    return true;
+  }
+
+  return parseRawKeyCode(name, code);
+}
+
+// Parses the inside of "[keyboard name="..." vendor=0x1 ...]"
+static bool parseSectionHeader(std::string const& text,
+                               bool* hasName,
+                               std::string* name,
+                               int* bustype,
+                               int* vendor,
+                               int* product,
+                               std::string* error) {
+  std::istringstream input(text);
+  std::string word;
+
+  input >> word;
+
+  if (word != "keyboard") {
+    *error = "unknown section \"" + word + "\"";
+
+    return false;
+  }
+
+  while (input >> std::ws && !input.eof()) {
+    std::string key;
+    std::string value;
+
+    if (!std::getline(input, key, '=')) {
+      *error = "expected attribute=value";
+
+      return false;
+    }
+
+    key = trim(key);
+
+    if (input.peek() == '"') {
+      input.get();
+      std::getline(input, value, '"');
+    } else {
+      input >> value;
+    }
+
+    if (key == "name") {
+      *hasName = true;
+      *name = value;
+    } else if (key == "bustype" || key == "vendor" || key == "product") {
+      int* number = key == "bustype" ? bustype : key == "vendor" ? vendor : product;
+
+      if (!parseNumber(value, number)) {
+        *error = "invalid " + key + " \"" + value + "\"";
+
+        return false;
+      }
+    } else {
+      *error = "unknown attribute \"" + key + "\"";
+
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool KeymapConfig::Section::matches(DeviceIdentity const& identity) const {
+  return (!hasName || name == identity.name)
+         && (bustype < 0 || bustype == identity.bustype)
+         && (vendor < 0 || vendor == identity.vendor)
+         && (product < 0 || product == identity.product);
+}
+
+KeymapConfig::KeymapConfig() {
+  std::istringstream input(defaultConfig);
+
+  parse(input, "default keymap");
+}
+
+bool KeymapConfig::load(std::string const& path) {
+  std::ifstream input(path);
+
+  if (!input) {
+    logError("Failed to read %s", path.c_str());
+
+    return false;
+  }
+
+  return parse(input, path);
+}
+
+bool KeymapConfig::parse(std::istream& input, std::string const& name) {
+  std::vector<Section> sections(1);
+  std::string line;
+  unsigned lineNumber = 0;
+  std::string error;
+
+  sections.back().hasName = false;
+  sections.back().bustype = -1;
+  sections.back().vendor = -1;
+  sections.back().product = -1;
+
+  while (error.empty() && std::getline(input, line)) {
+    ++lineNumber;
+    line = trim(line.substr(0, line.find('#')));
+
+    if (line.empty()) {
+      continue;
+    }
+
+    if (line.front() == '[') {
+      if (line.back() != ']') {
+        error = "unterminated section";
+
+        break;
+      }
+
+      Section section;
+      section.hasName = false;
+      section.bustype = -1;
+      section.vendor = -1;
+      section.product = -1;
+
+      if (parseSectionHeader(line.substr(1, line.size() - 2),
+                             &section.hasName,
+                             &section.name,
+                             &section.bustype,
+                             &section.vendor,
+                             &section.product,
+                             &error)) {
+        sections.push_back(section);
+      }
+
+      continue;
+    }
+
+    std::size_t equals = line.find('=');
+
+    if (equals == std::string::npos) {
+      error = "expected KEY = TARGET";
+
+      break;
+    }
+
+    std::string key = trim(line.substr(0, equals));
+    std::string target = trim(line.substr(equals + 1));
+    Rule rule;
+
+    if (!parseKeyCode(key, &rule.code)) {
+      error = "unknown key \"" + key + "\"";
+
+      break;
+    }
+
+    if (target == "semicolon") {
+      rule.action = Action::Semicolon;
+    } else if (target == "none") {
+      rule.action = Action::Drop;
+    } else {
+      std::istringstream keys(target);
+      std::string targetKey;
+
+      while (std::getline(keys, targetKey, '+')) {
+        KeyCode code;
+
+        if (!parseKeyCode(trim(targetKey), &code)) {
+          error = "unknown key \"" + trim(targetKey) + "\"";
+
+          break;
+        }
+
+        rule.targets.push_back(code);
+      }
+
+      if (rule.targets.empty() && error.empty()) {
+        error = "missing target of \"" + key + "\"";
+      } else if (rule.targets.size() > maxChordKeys) {
+        error = "chord of more than " + std::to_string(maxChordKeys) + " keys";
+      }
+
+      rule.action = rule.targets.size() > 1 ? Action::Chord : Action::Remap;
+    }
+
+    sections.back().rules.push_back(rule);
+  }
+
+  if (!error.empty()) {
+    logError("%s:%u: %s", name.c_str(), lineNumber, error.c_str());
+
+    return false;
+  }
+
+  _sections.swap(sections);
+
+  return true;
+}
+
+std::shared_ptr<Keymap const> KeymapConfig::compile(DeviceIdentity const& identity) const {
+  std::shared_ptr<Keymap> keymap(new Keymap());
+
+  for (Section const& section : _sections) {
+    if (!section.matches(identity)) {
+      continue;
+    }
+
+    for (Rule const& rule : section.rules) {
+      switch (rule.action) {
+      case Action::Remap:
+        keymap->remap(rule.code, rule.targets.front());
+        break;
+
+      case Action::Chord:
+        keymap->bindChord(rule.code, rule.targets);
+        break;
+
+      case Action::Semicolon:
+      case Action::Drop:
+        keymap->bind(rule.code, rule.action);
+        break;
+      }
+    }
+  }
+
+  for (KeyCode code = 0; code < KEY_CNT; ++code) {
+    KeyAction const& action = (*keymap)[code];
+
+    if (action.action == Action::Remap) {
+      keymap->track(code, trackedKeyOf(code, action.code));
+    }
+  }
+
+  return keymap;
+}
+} // namespace Reader
+} // namespace KeyboardHook
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <istream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "Keymap.hpp"
+
+namespace KeyboardHook {
+namespace Reader {
+// What a keymap section can be restricted to, as read by gatherInfo()
+struct DeviceIdentity {
+  std::string name;
+  int bustype;
+  int vendor;
+  int product;
+};
+
+// Remapping rules read from a configuration file:
+//
+//   # Comment
+//   [keyboard]                                  applies to every keyboard
+//   CAPSLOCK = ESC                              remaps a key
+//   [keyboard name="AT Translated Set 2 keyboard" vendor=0x1 product=0x1]
+//   SEMICOLON = semicolon                       ";" and "Alt-;" rewrite
+//   F13 = LEFTCTRL+C                            chord
+//   INSERT = none                               disables a key
+//
+// Keys are named as in linux/input-event-codes.h, with or without the KEY_
+// prefix ("1" is the digit key), or given as codes in hex: "0x1e". The
+// sections matching a device apply in the order of the file, so later ones
+// override earlier ones.
+class KeymapConfig {
+public:
+  // The remapping this hook always did: CapsLock to Escape, the 102nd key to
+  // left Shift, Compose and SysRq to left Meta
+  static char const* const defaultConfig;
+
+  KeymapConfig();
+
+  // Reads the rules from the file, returns false (and logs why) if the file
+  // cannot be read or is malformed
+  bool load(std::string const& path);
+
+  // Same as load() from any stream, the name is only used in messages
+  bool parse(std::istream& input, std::string const& name);
+
+  // Builds the lookup table of a device from the sections that match it
+  std::shared_ptr<Keymap const> compile(DeviceIdentity const& identity) const;
+
+private:
+  struct Rule {
+    KeyCode code;
+    Action action;
+    std::vector<KeyCode> targets;
+  };
+
+  struct Section {
+    bool hasName;
+    std::string name;
+    int bustype;
+    int vendor;
+    int product;
+    std::vector<Rule> rules;
+
+    bool matches(DeviceIdentity const& identity) const;
+  };
+
+  std::vector<Section> _sections;
+};
+} // namespace Reader
+} // namespace KeyboardHook
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace KeyboardHook {
+namespace Reader {
+// Histogram of nanoseconds in log-linear buckets, 16 per power of two, so that
+// a bucket is within 6% of the values it counts. Recording never allocates or
+// locks: the forwarding loop is the only writer, and readers on other threads
+// see every count as it was at some point.
+class LatencyHistogram {
+public:
+  static std::size_t const subBucketBits = 4;
+
+  static std::size_t const subBucketCount = std::size_t(1) << subBucketBits;
+
+  // Values from 2^41 ns (36 minutes) on are counted in the last bucket
+  static std::size_t const maxExponent = 40;
+
+  static std::size_t const bucketCount = (maxExponent - subBucketBits + 2) * subBucketCount;
+
+  LatencyHistogram() : _counts(), _count(0), _max(0) {}
+
+  LatencyHistogram(LatencyHistogram const&) = delete;
+
+  LatencyHistogram& operator=(LatencyHistogram const&) = delete;
+
+  void record(std::int64_t nanoseconds) {
+    std::uint64_t value = nanoseconds < 0 ? 0 : (std::uint64_t)nanoseconds;
+
+    increment(_counts[bucketOf(value)]);
+    increment(_count);
+
+    if (value > _max.load(std::memory_order_relaxed)) {
+      _max.store(value, std::memory_order_relaxed);
+    }
+  }
+
+  std::uint64_t count() const { return _count.load(std::memory_order_relaxed); }
+
+  std::uint64_t max() const { return _max.load(std::memory_order_relaxed); }
+
+  std::uint64_t bucketCountAt(std::size_t bucket) const {
+    return _counts[bucket].load(std::memory_order_relaxed);
+  }
+
+  // Smallest value counted in the bucket
+  static std::uint64_t lowerBound(std::size_t bucket) {
+    if (bucket < subBucketCount) {
+      return bucket;
+    }
+
+    std::size_t exponent = bucket / subBucketCount + subBucketBits - 1;
+
+    return (subBucketCount + bucket % subBucketCount) << (exponent - subBucketBits);
+  }
+
+  // Lower bound of the bucket the fraction of the values is at, 0 if empty
+  std::uint64_t percentile(double fraction) const {
+    std::uint64_t const total = count();
+    std::uint64_t const rank = (std::uint64_t)(fraction * total);
+    std::uint64_t seen = 0;
+
+    for (std::size_t bucket = 0; bucket < bucketCount && total > 0; ++bucket) {
+      seen += bucketCountAt(bucket);
+
+      if (seen > rank) {
+        return lowerBound(bucket);
+      }
+    }
+
+    return max();
+  }
+
+private:
+  static std::size_t bucketOf(std::uint64_t value) {
+    if (value < subBucketCount) {
+      return value;
+    }
+
+    std::size_t exponent = 63 - __builtin_clzll(value);
+
+    if (exponent > maxExponent) {
+      return bucketCount - 1;
+    }
+
+    return (exponent - subBucketBits + 1) * subBucketCount
+           + ((value >> (exponent - subBucketBits)) & (subBucketCount - 1));
+  }
+
+  // A single writer needs no read-modify-write
+  static void increment(std::atomic<std::uint64_t>& counter) {
+    counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  }
+
+  std::array<std::atomic<std::uint64_t>, bucketCount> _counts;
+  std::atomic<std::uint64_t> _count;
+  std::atomic<std::uint64_t> _max;
+};
+
+// Where the time of the key events a device forwards goes
+struct StageLatencies {
+  // From the kernel stamping the event to the Reader reading it
+  LatencyHistogram wakeup;
+  // From reading the event to handleEvent() returning
+  LatencyHistogram remap;
+  // From handleEvent() returning to the writer taking the frame
+  LatencyHistogram injection;
+  // All of the above
+  LatencyHistogram total;
+};
+} // namespace Reader
+} // namespace KeyboardHook
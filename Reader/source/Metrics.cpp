@@ -0,0 +1,298 @@
+#include "Metrics.hpp"
+
+#include <poll.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <vector>
+
+#include "log.hpp"
+
+namespace KeyboardHook {
+namespace Reader {
+// How long a client may take to read a snapshot
+static int const clientTimeoutSeconds = 1;
+
+static std::string escapeLabel(std::string const& value) {
+  std::string escaped;
+
+  for (char c : value) {
+    if (c == '\\' || c == '"') {
+      escaped += '\\';
+      escaped += c;
+    } else if (c == '\n') {
+      escaped += "\\n";
+    } else {
+      escaped += c;
+    }
+  }
+
+  return escaped;
+}
+
+MetricsServer::MetricsServer()
+  : _socketInode(0), _listenFileDescriptor(-1), _stopFileDescriptor(-1) {}
+
+MetricsServer::~MetricsServer() {
+  if (_thread.joinable()) {
+    eventfd_write(_stopFileDescriptor, 1);
+    _thread.join();
+  }
+
+  if (_stopFileDescriptor >= 0) {
+    close(_stopFileDescriptor);
+  }
+
+  struct stat status;
+
+  if (_listenFileDescriptor >= 0) {
+    close(_listenFileDescriptor);
+
+    if (stat(_path.c_str(), &status) == 0 && status.st_ino == _socketInode) {
+      unlink(_path.c_str());
+    }
+  }
+}
+
+bool MetricsServer::start(std::string const& path) {
+  if (mkdir(KEYBOARD_HOOK_READER_RUNTIME_DIRECTORY, 0700) != 0 && errno != EEXIST) {
+    logError("Failed to create %s: %s", KEYBOARD_HOOK_READER_RUNTIME_DIRECTORY, strerror(errno));
+
+    return false;
+  }
+
+  struct sockaddr_un address = {};
+
+  address.sun_family = AF_UNIX;
+  std::strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+
+  _path = path;
+  _listenFileDescriptor = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  _stopFileDescriptor = eventfd(0, EFD_CLOEXEC);
+
+  unlink(address.sun_path);
+
+  if (_listenFileDescriptor < 0 || _stopFileDescriptor < 0
+      || bind(_listenFileDescriptor, (struct sockaddr const*)&address, sizeof(address)) != 0
+      || listen(_listenFileDescriptor, 4) != 0) {
+    logError("Failed to serve metrics on %s: %s", path.c_str(), strerror(errno));
+
+    return false;
+  }
+
+  struct stat status;
+
+  if (stat(path.c_str(), &status) == 0) {
+    _socketInode = status.st_ino;
+  }
+
+  _thread = std::thread(&MetricsServer::serve, this);
+
+  return true;
+}
+
+void MetricsServer::add(unsigned number,
+                        std::string const& path,
+                        std::string const& name,
+                        std::shared_ptr<DeviceMetrics const> metrics) {
+  std::lock_guard<std::mutex> lock(_mutex);
+
+  _devices[number] = Entry{path, name, std::move(metrics)};
+}
+
+void MetricsServer::remove(unsigned number) {
+  std::lock_guard<std::mutex> lock(_mutex);
+
+  _devices.erase(number);
+}
+
+std::string MetricsServer::format() {
+  std::vector<Entry> devices;
+
+  // The metrics outlive a device removed meanwhile
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    for (auto const& device : _devices) {
+      devices.push_back(device.second);
+    }
+  }
+
+  std::string text;
+  char line[512];
+
+  auto labels = [](Entry const& device) {
+    return "device=\"" + escapeLabel(device.path) + "\",name=\"" + escapeLabel(device.name)
+           + "\"";
+  };
+
+  auto family = [&](char const* name,
+                    char const* type,
+                    char const* help,
+                    std::function<std::uint64_t(DeviceMetrics const&)> value) {
+    std::snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+    text += line;
+
+    for (Entry const& device : devices) {
+      std::snprintf(line,
+                    sizeof(line),
+                    "%s{%s} %llu\n",
+                    name,
+                    labels(device).c_str(),
+                    (unsigned long long)value(*device.metrics));
+      text += line;
+    }
+  };
+
+  auto summary = [&](char const* name,
+                     std::function<LatencyHistogram const&(DeviceMetrics const&)> histogram,
+                     char const* extraLabels) {
+    for (Entry const& device : devices) {
+      LatencyHistogram const& values = histogram(*device.metrics);
+      std::string deviceLabels = labels(device) + extraLabels;
+
+      for (double quantile : {0.5, 0.99, 0.999}) {
+        std::snprintf(line,
+                      sizeof(line),
+                      "%s{%s,quantile=\"%g\"} %.9f\n",
+                      name,
+                      deviceLabels.c_str(),
+                      quantile,
+                      values.percentile(quantile) / 1e9);
+        text += line;
+      }
+
+      std::snprintf(line,
+                    sizeof(line),
+                    "%s_count{%s} %llu\n",
+                    name,
+                    deviceLabels.c_str(),
+                    (unsigned long long)values.count());
+      text += line;
+    }
+  };
+
+  family("keyboard_hook_events_read_total",
+         "counter",
+         "Events read from the device",
+         [](DeviceMetrics const& metrics) { return metrics.eventsRead.load(); });
+  family("keyboard_hook_events_remapped_total",
+         "counter",
+         "Events the keymap changed or consumed",
+         [](DeviceMetrics const& metrics) { return metrics.eventsRemapped.load(); });
+  family("keyboard_hook_frames_injected_total",
+         "counter",
+         "Frames handed to the writer",
+         [](DeviceMetrics const& metrics) { return metrics.framesInjected.load(); });
+  family("keyboard_hook_write_errors_total",
+         "counter",
+         "Failed writes to the writer",
+         [](DeviceMetrics const& metrics) { return metrics.writeErrors.load(); });
+  family("keyboard_hook_syn_dropped_total",
+         "counter",
+         "Times the kernel dropped events of the device",
+         [](DeviceMetrics const& metrics) { return metrics.droppedCount.load(); });
+  family("keyboard_hook_frame_high_water",
+         "gauge",
+         "Most events in the frame buffer at once",
+         [](DeviceMetrics const& metrics) { return metrics.frameHighWater.load(); });
+  family("keyboard_hook_ring_high_water",
+         "gauge",
+         "Most events in the ring of the writer at once",
+         [](DeviceMetrics const& metrics) { return metrics.ringHighWater.load(); });
+  family("keyboard_hook_grabbed",
+         "gauge",
+         "Whether the device is grabbed",
+         [](DeviceMetrics const& metrics) { return metrics.isGrabbed.load(); });
+  family("keyboard_hook_remapped_in_kernel",
+         "gauge",
+         "Whether the writer remaps the device",
+         [](DeviceMetrics const& metrics) { return metrics.isRemappedInKernel.load(); });
+
+  text += "# HELP keyboard_hook_resync_seconds Time from dropped events to the resync\n"
+          "# TYPE keyboard_hook_resync_seconds summary\n";
+  summary("keyboard_hook_resync_seconds",
+          [](DeviceMetrics const& metrics) -> LatencyHistogram const& {
+            return metrics.resync;
+          },
+          "");
+
+  text += "# HELP keyboard_hook_key_latency_seconds Time key events spend in the Reader\n"
+          "# TYPE keyboard_hook_key_latency_seconds summary\n";
+
+  struct Stage {
+    char const* labels;
+    LatencyHistogram StageLatencies::*histogram;
+  };
+
+  for (Stage const& stage : {Stage{",stage=\"wakeup\"", &StageLatencies::wakeup},
+                             Stage{",stage=\"remap\"", &StageLatencies::remap},
+                             Stage{",stage=\"injection\"", &StageLatencies::injection},
+                             Stage{",stage=\"total\"", &StageLatencies::total}}) {
+    summary("keyboard_hook_key_latency_seconds",
+            [&](DeviceMetrics const& metrics) -> LatencyHistogram const& {
+              return metrics.latencies.*stage.histogram;
+            },
+            stage.labels);
+  }
+
+  return text;
+}
+
+void MetricsServer::serve() {
+  struct pollfd descriptors[] = {
+    {_listenFileDescriptor, POLLIN, 0},
+    {_stopFileDescriptor, POLLIN, 0},
+  };
+
+  while (true) {
+    if (poll(descriptors, 2, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      logError("Failed to wait for metrics clients: %s", strerror(errno));
+
+      return;
+    }
+
+    if (descriptors[1].revents != 0) {
+      return;
+    }
+
+    int client = accept4(_listenFileDescriptor, NULL, NULL, SOCK_CLOEXEC);
+
+    if (client < 0) {
+      continue;
+    }
+
+    struct timeval timeout = {clientTimeoutSeconds, 0};
+
+    setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    std::string const text = format();
+
+    for (std::size_t written = 0; written < text.size();) {
+      ssize_t result
+        = send(client, text.data() + written, text.size() - written, MSG_NOSIGNAL);
+
+      if (result <= 0) {
+        break;
+      }
+
+      written += result;
+    }
+
+    close(client);
+  }
+}
+} // namespace Reader
+} // namespace KeyboardHook
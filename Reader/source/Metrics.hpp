@@ -0,0 +1,112 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "LatencyHistogram.hpp"
+#include "handoff.hpp"
+
+// Socket the counters of the devices are served on, in the Prometheus text
+// format
+#define KEYBOARD_HOOK_READER_METRICS_SOCKET KEYBOARD_HOOK_READER_RUNTIME_DIRECTORY "/metrics"
+
+namespace KeyboardHook {
+namespace Reader {
+// Counter with a single writer, readers on other threads see every value it
+// had without either of them locking
+class Counter {
+public:
+  Counter() : _value(0) {}
+
+  Counter(Counter const&) = delete;
+
+  Counter& operator=(Counter const&) = delete;
+
+  void add(std::uint64_t count = 1) { set(load() + count); }
+
+  // Keeps the highest value set, for high-water marks
+  void raise(std::uint64_t value) {
+    if (value > load()) {
+      set(value);
+    }
+  }
+
+  void set(std::uint64_t value) { _value.store(value, std::memory_order_relaxed); }
+
+  std::uint64_t load() const { return _value.load(std::memory_order_relaxed); }
+
+private:
+  std::atomic<std::uint64_t> _value;
+};
+
+// What the forwarding loop did with the events of a device, shared with the
+// metrics server that reads it at any time
+struct DeviceMetrics {
+  Counter eventsRead;
+  // Events the keymap changed or consumed
+  Counter eventsRemapped;
+  Counter framesInjected;
+  Counter writeErrors;
+  Counter droppedCount;
+  // Most events in the frame buffer and in the ring of the writer at once
+  Counter frameHighWater;
+  Counter ringHighWater;
+  Counter isGrabbed;
+  Counter isRemappedInKernel;
+  // From the kernel dropping events to the key state being resynced
+  LatencyHistogram resync;
+  StageLatencies latencies;
+};
+
+// Serves the metrics of the devices on a Unix socket from a thread of its own,
+// a client gets a snapshot on connecting. Devices are added and removed under
+// a lock, their counters are read without one.
+class MetricsServer {
+public:
+  MetricsServer();
+
+  MetricsServer(MetricsServer const&) = delete;
+
+  ~MetricsServer();
+
+  MetricsServer& operator=(MetricsServer const&) = delete;
+
+  bool start(std::string const& path);
+
+  void add(unsigned number,
+           std::string const& path,
+           std::string const& name,
+           std::shared_ptr<DeviceMetrics const> metrics);
+
+  void remove(unsigned number);
+
+  // Snapshot in the Prometheus text format
+  std::string format();
+
+private:
+  struct Entry {
+    std::string path;
+    std::string name;
+    std::shared_ptr<DeviceMetrics const> metrics;
+  };
+
+  void serve();
+
+  std::string _path;
+  // Inode of the socket bound, a daemon taking over binds its own
+  ino_t _socketInode;
+  int _listenFileDescriptor;
+  int _stopFileDescriptor;
+  std::thread _thread;
+  std::mutex _mutex;
+  std::map<unsigned, Entry> _devices;
+};
+} // namespace Reader
+} // namespace KeyboardHook
@@ -0,0 +1,217 @@
+#include "Trace.hpp"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+
+#include "log.hpp"
+
+namespace KeyboardHook {
+namespace Reader {
+static bool writeAll(int fileDescriptor, void const* data, std::size_t size) {
+  char const* bytes = static_cast<char const*>(data);
+
+  while (size > 0) {
+    ssize_t result = write(fileDescriptor, bytes, size);
+
+    if (result < 0 && errno == EINTR) {
+      continue;
+    }
+
+    if (result <= 0) {
+      return false;
+    }
+
+    bytes += result;
+    size -= result;
+  }
+
+  return true;
+}
+
+std::int64_t toTraceTime(struct timeval const& time) {
+  return (std::int64_t)time.tv_sec * 1000000000 + (std::int64_t)time.tv_usec * 1000;
+}
+
+struct timeval fromTraceTime(std::int64_t time) {
+  struct timeval result;
+
+  result.tv_sec = time / 1000000000;
+  result.tv_usec = time % 1000000000 / 1000;
+
+  return result;
+}
+
+TraceWriter::TraceWriter() : _fileDescriptor(-1), _recordCount(0) {}
+
+TraceWriter::~TraceWriter() {
+  if (_fileDescriptor >= 0) {
+    flush();
+    close(_fileDescriptor);
+  }
+}
+
+bool TraceWriter::open(std::string const& path,
+                       std::vector<TraceDevice> devices,
+                       std::vector<std::vector<unsigned char>> const& descriptors) {
+  _path = path;
+  _fileDescriptor = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+  if (_fileDescriptor < 0) {
+    logError("Failed to create %s: %s", path.c_str(), strerror(errno));
+
+    return false;
+  }
+
+  // The buffer is allocated once, appending never does
+  _buffer.reserve(bufferCapacity);
+
+  TraceHeader header
+    = {traceMagic, traceVersion, (std::uint32_t)devices.size(), sizeof(TraceRecord)};
+
+  for (std::size_t i = 0; i < devices.size(); ++i) {
+    devices[i].descriptorSize = i < descriptors.size() ? descriptors[i].size() : 0;
+  }
+
+  bool isWritten
+    = writeAll(_fileDescriptor, &header, sizeof(header))
+      && writeAll(_fileDescriptor, devices.data(), devices.size() * sizeof(TraceDevice));
+
+  for (std::size_t i = 0; isWritten && i < std::min(descriptors.size(), devices.size());
+       ++i) {
+    static char const padding[traceAlignment] = {};
+
+    isWritten = writeAll(_fileDescriptor, descriptors[i].data(), descriptors[i].size())
+                && writeAll(_fileDescriptor,
+                            padding,
+                            (traceAlignment - descriptors[i].size() % traceAlignment)
+                              % traceAlignment);
+  }
+
+  if (!isWritten) {
+    logError("Failed to write %s: %s", path.c_str(), strerror(errno));
+
+    return false;
+  }
+
+  return true;
+}
+
+bool TraceWriter::append(std::uint16_t device, struct input_event const& event) {
+  TraceRecord record = {};
+
+  record.time = toTraceTime(event.time);
+  record.device = device;
+  record.type = event.type;
+  record.code = event.code;
+  record.value = event.value;
+
+  _buffer.push_back(record);
+
+  return _buffer.size() < bufferCapacity || flush();
+}
+
+bool TraceWriter::flush() {
+  if (_buffer.empty()) {
+    return true;
+  }
+
+  bool isWritten
+    = writeAll(_fileDescriptor, _buffer.data(), _buffer.size() * sizeof(TraceRecord));
+
+  if (!isWritten) {
+    logError("Failed to write %s: %s", _path.c_str(), strerror(errno));
+  }
+
+  _recordCount += _buffer.size();
+  _buffer.clear();
+
+  return isWritten;
+}
+
+TraceFile::TraceFile()
+  : _data(MAP_FAILED),
+    _size(0),
+    _header(NULL),
+    _devices(NULL),
+    _records(NULL),
+    _recordCount(0) {}
+
+TraceFile::~TraceFile() {
+  if (_data != MAP_FAILED) {
+    munmap(_data, _size);
+  }
+}
+
+bool TraceFile::open(std::string const& path) {
+  int fileDescriptor = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  struct stat status;
+
+  if (fileDescriptor < 0 || fstat(fileDescriptor, &status) != 0) {
+    logError("Failed to open %s: %s", path.c_str(), strerror(errno));
+
+    if (fileDescriptor >= 0) {
+      close(fileDescriptor);
+    }
+
+    return false;
+  }
+
+  _size = status.st_size;
+
+  if (_size >= sizeof(TraceHeader)) {
+    _data = mmap(NULL, _size, PROT_READ, MAP_PRIVATE, fileDescriptor, 0);
+  }
+
+  close(fileDescriptor);
+
+  if (_data == MAP_FAILED) {
+    logError("Failed to map %s", path.c_str());
+
+    return false;
+  }
+
+  char const* bytes = static_cast<char const*>(_data);
+  std::size_t recordsOffset = 0;
+
+  _header = static_cast<TraceHeader const*>(_data);
+  recordsOffset
+    = sizeof(TraceHeader) + (std::size_t)_header->deviceCount * sizeof(TraceDevice);
+
+  bool isValid = _header->magic == traceMagic && _header->version == traceVersion
+                 && _header->recordSize == sizeof(TraceRecord) && recordsOffset <= _size;
+
+  _devices = reinterpret_cast<TraceDevice const*>(bytes + sizeof(TraceHeader));
+
+  for (std::uint32_t i = 0; isValid && i < _header->deviceCount; ++i) {
+    std::size_t const size = _devices[i].descriptorSize;
+
+    _descriptors.push_back(reinterpret_cast<unsigned char const*>(bytes + recordsOffset));
+    recordsOffset += size + (traceAlignment - size % traceAlignment) % traceAlignment;
+    isValid = recordsOffset <= _size;
+  }
+
+  if (!isValid) {
+    logError("%s is not a trace of this version", path.c_str());
+
+    return false;
+  }
+
+  // A trace cut off while recording ends with the last whole record
+  _records = reinterpret_cast<TraceRecord const*>(bytes + recordsOffset);
+  _recordCount = (_size - recordsOffset) / sizeof(TraceRecord);
+
+  return true;
+}
+
+std::vector<unsigned char> TraceFile::descriptor(std::size_t index) const {
+  return std::vector<unsigned char>(_descriptors[index],
+                                    _descriptors[index] + _devices[index].descriptorSize);
+}
+} // namespace Reader
+} // namespace KeyboardHook
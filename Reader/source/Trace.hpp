@@ -0,0 +1,132 @@
+#pragma once
+
+#include <linux/input.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace KeyboardHook {
+namespace Reader {
+// A trace file is a header, the descriptors of the traced devices, the
+// descriptors of their virtual keyboards as the writer takes them (each padded
+// to traceAlignment), then the events as fixed-size records, all in host byte
+// order. It is read by mapping it as a whole.
+std::uint32_t const traceMagic = 0x4b485452;
+
+// Changes with the layout of the file
+std::uint32_t const traceVersion = 2;
+
+std::size_t const traceAlignment = 8;
+
+std::size_t const traceNameSize = 80;
+
+struct TraceHeader {
+  std::uint32_t magic;
+  std::uint32_t version;
+  std::uint32_t deviceCount;
+  std::uint32_t recordSize;
+};
+
+struct TraceDevice {
+  std::uint32_t number;
+  std::uint16_t bustype;
+  std::uint16_t vendor;
+  std::uint16_t product;
+  std::uint16_t version;
+  char name[traceNameSize];
+  // Size of the descriptor of the virtual keyboard
+  std::uint32_t descriptorSize;
+};
+
+struct TraceRecord {
+  // Monotonic nanoseconds the kernel stamped the event with
+  std::int64_t time;
+  // Index of the device in the descriptors of the file
+  std::uint16_t device;
+  std::uint16_t type;
+  std::uint16_t code;
+  std::uint16_t reserved;
+  std::int32_t value;
+  std::uint32_t reserved2;
+};
+
+static_assert(sizeof(TraceDevice) == 96, "Trace devices have a fixed size");
+
+static_assert(sizeof(TraceRecord) == 24, "Trace records have a fixed size");
+
+std::int64_t toTraceTime(struct timeval const& time);
+
+struct timeval fromTraceTime(std::int64_t time);
+
+// Streams the events into a trace file, in blocks of records
+class TraceWriter {
+public:
+  static std::size_t const bufferCapacity = 4096;
+
+  TraceWriter();
+
+  TraceWriter(TraceWriter const&) = delete;
+
+  // Writes the records still buffered
+  ~TraceWriter();
+
+  TraceWriter& operator=(TraceWriter const&) = delete;
+
+  // Creates the file with the devices traced and the descriptors of their
+  // virtual keyboards
+  bool open(std::string const& path,
+            std::vector<TraceDevice> devices,
+            std::vector<std::vector<unsigned char>> const& descriptors);
+
+  bool append(std::uint16_t device, struct input_event const& event);
+
+  bool flush();
+
+  std::uint64_t recordCount() const { return _recordCount; }
+
+private:
+  std::string _path;
+  int _fileDescriptor;
+  std::vector<TraceRecord> _buffer;
+  std::uint64_t _recordCount;
+};
+
+// Trace file mapped for reading
+class TraceFile {
+public:
+  TraceFile();
+
+  TraceFile(TraceFile const&) = delete;
+
+  ~TraceFile();
+
+  TraceFile& operator=(TraceFile const&) = delete;
+
+  // Returns false (and logs why) if the file cannot be mapped or is not a
+  // trace of this version
+  bool open(std::string const& path);
+
+  std::size_t deviceCount() const { return _header->deviceCount; }
+
+  TraceDevice const& device(std::size_t index) const { return _devices[index]; }
+
+  // Descriptor of the virtual keyboard of the device
+  std::vector<unsigned char> descriptor(std::size_t index) const;
+
+  std::size_t recordCount() const { return _recordCount; }
+
+  TraceRecord const* records() const { return _records; }
+
+private:
+  void* _data;
+  std::size_t _size;
+  TraceHeader const* _header;
+  TraceDevice const* _devices;
+  std::vector<unsigned char const*> _descriptors;
+  TraceRecord const* _records;
+  std::size_t _recordCount;
+};
+} // namespace Reader
+} // namespace KeyboardHook
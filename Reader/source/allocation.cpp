@@ -0,0 +1,52 @@
+#include "allocation.hpp"
+
+#include <cstdlib>
+#include <new>
+
+namespace {
+// Count of the innermost counter of the thread, NULL outside of one
+thread_local std::uint64_t* countedAllocations = NULL;
+} // namespace
+
+// The other forms of new and delete end up in these
+void* operator new(std::size_t size) {
+  if (countedAllocations != NULL) {
+    ++*countedAllocations;
+  }
+
+  while (true) {
+    void* pointer = std::malloc(size == 0 ? 1 : size);
+
+    if (pointer != NULL) {
+      return pointer;
+    }
+
+    std::new_handler handler = std::get_new_handler();
+
+    if (handler == NULL) {
+      throw std::bad_alloc();
+    }
+
+    handler();
+  }
+}
+
+void operator delete(void* pointer) noexcept {
+  std::free(pointer);
+}
+
+void operator delete(void* pointer, std::size_t) noexcept {
+  std::free(pointer);
+}
+
+namespace KeyboardHook {
+namespace Reader {
+AllocationCounter::AllocationCounter() : _previous(countedAllocations), _count(0) {
+  countedAllocations = &_count;
+}
+
+AllocationCounter::~AllocationCounter() {
+  countedAllocations = _previous;
+}
+} // namespace Reader
+} // namespace KeyboardHook
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstdint>
+
+namespace KeyboardHook {
+namespace Reader {
+// While alive, counts the allocations the calling thread makes through
+// operator new, the event path is meant to have none. Programs linking the
+// remapping library get its operator new, which only counts inside a counter
+// and otherwise allocates as the standard one does.
+class AllocationCounter {
+public:
+  AllocationCounter();
+
+  AllocationCounter(AllocationCounter const&) = delete;
+
+  ~AllocationCounter();
+
+  AllocationCounter& operator=(AllocationCounter const&) = delete;
+
+  std::uint64_t count() const { return _count; }
+
+private:
+  std::uint64_t* _previous;
+  std::uint64_t _count;
+};
+} // namespace Reader
+} // namespace KeyboardHook
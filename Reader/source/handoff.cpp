@@ -0,0 +1,201 @@
+#include "handoff.hpp"
+
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+
+#include "log.hpp"
+
+namespace KeyboardHook {
+namespace Reader {
+static struct sockaddr_un handoffAddress() {
+  struct sockaddr_un address = {};
+
+  address.sun_family = AF_UNIX;
+  std::strncpy(
+    address.sun_path, KEYBOARD_HOOK_READER_HANDOFF_SOCKET, sizeof(address.sun_path) - 1);
+
+  return address;
+}
+
+int listenForHandoff() {
+  // Only the owner may take the devices over
+  if (mkdir(KEYBOARD_HOOK_READER_RUNTIME_DIRECTORY, 0700) != 0 && errno != EEXIST) {
+    logError("Failed to create %s: %s", KEYBOARD_HOOK_READER_RUNTIME_DIRECTORY, strerror(errno));
+
+    return -1;
+  }
+
+  int fileDescriptor = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  struct sockaddr_un address = handoffAddress();
+
+  // A socket left over by a daemon that is gone is replaced
+  unlink(address.sun_path);
+
+  if (fileDescriptor < 0
+      || bind(fileDescriptor, (struct sockaddr const*)&address, sizeof(address)) != 0
+      || listen(fileDescriptor, 1) != 0) {
+    logError("Failed to listen on %s: %s", address.sun_path, strerror(errno));
+
+    if (fileDescriptor >= 0) {
+      close(fileDescriptor);
+    }
+
+    return -1;
+  }
+
+  return fileDescriptor;
+}
+
+int connectForHandoff(bool isRequired) {
+  int fileDescriptor = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  struct sockaddr_un address = handoffAddress();
+
+  if (fileDescriptor < 0
+      || connect(fileDescriptor, (struct sockaddr const*)&address, sizeof(address)) != 0) {
+    // A daemon that is gone leaves its socket behind
+    if (isRequired || (errno != ENOENT && errno != ECONNREFUSED)) {
+      logError("No daemon to take over from on %s: %s", address.sun_path, strerror(errno));
+    }
+
+    if (fileDescriptor >= 0) {
+      close(fileDescriptor);
+    }
+
+    return -1;
+  }
+
+  return fileDescriptor;
+}
+
+bool notifyService(char const* state) {
+  char const* path = std::getenv("NOTIFY_SOCKET");
+  struct sockaddr_un address = {};
+
+  if (path == NULL || (path[0] != '/' && path[0] != '@')
+      || std::strlen(path) >= sizeof(address.sun_path)) {
+    return false;
+  }
+
+  std::size_t const length = std::strlen(path);
+
+  address.sun_family = AF_UNIX;
+  std::memcpy(address.sun_path, path, length);
+
+  // An abstract socket
+  if (address.sun_path[0] == '@') {
+    address.sun_path[0] = '\0';
+  }
+
+  int fileDescriptor = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+
+  if (fileDescriptor < 0) {
+    return false;
+  }
+
+  bool isSent = sendto(fileDescriptor,
+                       state,
+                       std::strlen(state),
+                       MSG_NOSIGNAL,
+                       (struct sockaddr const*)&address,
+                       offsetof(struct sockaddr_un, sun_path) + length)
+                >= 0;
+
+  close(fileDescriptor);
+
+  return isSent;
+}
+
+bool sendMessage(int socket,
+                 void const* data,
+                 std::size_t size,
+                 int const* fileDescriptors,
+                 std::size_t count) {
+  alignas(struct cmsghdr) char control[CMSG_SPACE(sizeof(int) * maxHandoffDescriptors)];
+  struct iovec vector;
+  struct msghdr message = {};
+
+  vector.iov_base = const_cast<void*>(data);
+  vector.iov_len = size;
+  message.msg_iov = &vector;
+  message.msg_iovlen = 1;
+
+  if (count > 0) {
+    message.msg_control = control;
+    message.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+
+    struct cmsghdr* header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(int) * count);
+    std::memcpy(CMSG_DATA(header), fileDescriptors, sizeof(int) * count);
+  }
+
+  return sendmsg(socket, &message, MSG_NOSIGNAL) == (ssize_t)size;
+}
+
+bool receiveMessage(int socket,
+                    void* data,
+                    std::size_t size,
+                    int* fileDescriptors,
+                    std::size_t count) {
+  alignas(struct cmsghdr) char control[CMSG_SPACE(sizeof(int) * maxHandoffDescriptors)];
+  int received[maxHandoffDescriptors];
+  std::size_t receivedCount = 0;
+  struct iovec vector;
+  struct msghdr message = {};
+
+  vector.iov_base = data;
+  vector.iov_len = size;
+  message.msg_iov = &vector;
+  message.msg_iovlen = 1;
+  message.msg_control = control;
+  message.msg_controllen = sizeof(control);
+
+  ssize_t result = recvmsg(socket, &message, MSG_CMSG_CLOEXEC);
+
+  if (result >= 0) {
+    for (struct cmsghdr* header = CMSG_FIRSTHDR(&message); header != NULL;
+         header = CMSG_NXTHDR(&message, header)) {
+      if (header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS) {
+        continue;
+      }
+
+      std::size_t headerCount = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+      for (std::size_t i = 0; i < headerCount; ++i) {
+        int fileDescriptor;
+
+        std::memcpy(&fileDescriptor, CMSG_DATA(header) + i * sizeof(int), sizeof(int));
+
+        if (receivedCount < maxHandoffDescriptors) {
+          received[receivedCount++] = fileDescriptor;
+        } else {
+          close(fileDescriptor);
+        }
+      }
+    }
+  }
+
+  if (result != (ssize_t)size || receivedCount != count
+      || (message.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) != 0) {
+    for (std::size_t i = 0; i < receivedCount; ++i) {
+      close(received[i]);
+    }
+
+    return false;
+  }
+
+  std::memcpy(fileDescriptors, received, sizeof(int) * count);
+
+  return true;
+}
+} // namespace Reader
+} // namespace KeyboardHook
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Sockets of the daemon, only the owner may use them
+#define KEYBOARD_HOOK_READER_RUNTIME_DIRECTORY "/run/keyboard-hook"
+
+// Socket a running daemon hands its devices over on
+#define KEYBOARD_HOOK_READER_HANDOFF_SOCKET KEYBOARD_HOOK_READER_RUNTIME_DIRECTORY "/handoff"
+
+namespace KeyboardHook {
+namespace Reader {
+std::uint32_t const handoffMagic = 0x4b48484f;
+
+// Changes with the layout of the messages
+std::uint32_t const handoffVersion = 1;
+
+// Descriptors sent along with a single message at most
+std::size_t const maxHandoffDescriptors = 2;
+
+// First message of a handoff, the devices follow a message each along with
+// their descriptors
+struct HandoffHeader {
+  std::uint32_t magic;
+  std::uint32_t version;
+  std::uint32_t deviceCount;
+  std::uint32_t deviceSize;
+};
+
+// Listening socket a newer daemon connects to, -1 on failure
+int listenForHandoff();
+
+// Socket connected to the running daemon, -1 if there is none. Its absence
+// is only an error if isRequired.
+int connectForHandoff(bool isRequired);
+
+// Sends the state to the service manager the daemon runs under, returns false
+// without one
+bool notifyService(char const* state);
+
+// Sends the message along with the descriptors, returns false on failure
+bool sendMessage(int socket,
+                 void const* data,
+                 std::size_t size,
+                 int const* fileDescriptors,
+                 std::size_t count);
+
+// Receives a message of exactly size bytes carrying exactly count descriptors,
+// returns false (and closes whatever descriptors came) otherwise
+bool receiveMessage(int socket,
+                    void* data,
+                    std::size_t size,
+                    int* fileDescriptors,
+                    std::size_t count);
+} // namespace Reader
+} // namespace KeyboardHook
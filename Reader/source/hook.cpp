@@ -2,104 +2,33 @@
 
 #include <fcntl.h>
 #include <libevdev-1.0/libevdev/libevdev.h>
+#include <signal.h>
 #include <string.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
-#include <cstdarg>
+#include <cerrno>
 #include <cstdio>
 #include <iostream>
+#include <memory>
 #include <set>
 #include <string>
 #include <thread>
 #include <vector>
 
+#include "Daemon.hpp"
+#include "Device.hpp"
 #include "EventHandler.hpp"
+#include "FrameBuffer.hpp"
+#include "KeymapConfig.hpp"
+#include "Trace.hpp"
+#include "handoff.hpp"
+#include "log.hpp"
 
 #define KEYBOARD_HOOK_WRITER_INPUT_KEYBOARD_DEVICE_MASTER "/dev/input/event"
 
-#define KEYBOARD_HOOK_WRITER_DEVICE_INFO_BUFFER_DEVICE_PATH                              \
-  "/dev/keyboard_hook_writer_device_info_buffer"
-
-#define KEYBOARD_HOOK_WRITER_INPUT_KEYBOARD_DEVICE_PATH                                  \
-  "/dev/keyboard_hook_writer_input_keyboard"
-
-EventQueue _eventQueue;
-bool _isEventHandled;
-
-class SimpleKey {
-public:
-  SimpleKey(unsigned int keyCode) : _keyCode(keyCode) {}
-
-  unsigned int& keyCode() { return _keyCode; }
-
-private:
-  unsigned int _keyCode;
-};
-
-SimpleKey capsLock(66);
-SimpleKey germanShift(94);
-SimpleKey semiColon(66);
-
-void logLog(char const* msg, char const* format, va_list args) {
-  fprintf(stdout, "[%s] ", msg);
-  vfprintf(stdout, format, args);
-  fprintf(stdout, "\n");
-}
-
-void logInfo(char const* format, ...) {
-  va_list args;
-  va_start(args, format);
-  logLog("INFO", format, args);
-  va_end(args);
-}
-
-void log_warn(char const* format, ...) {
-  va_list args;
-  va_start(args, format);
-  logLog("WARN", format, args);
-  va_end(args);
-}
-
-void logError(char const* format, ...) {
-  va_list args;
-  va_start(args, format);
-  logLog("ERROR", format, args);
-  va_end(args);
-}
-
-typedef std::vector<unsigned char> Buffer;
-
-Buffer deviceInfo;
-
-void writeToBuffer(Buffer* buffer, unsigned int value) {
-  unsigned char* pointer = (unsigned char*)(&value);
-  int count = sizeof(unsigned int) / sizeof(unsigned char);
-
-  for (int i = 0; i < count; ++i)
-    buffer->push_back(pointer[i]);
-}
-
-void writeToBuffer(Buffer* buffer, int value) {
-  unsigned char* pointer = (unsigned char*)(&value);
-  int count = sizeof(int) / sizeof(unsigned char);
-
-  for (int i = 0; i < count; ++i)
-    buffer->push_back(pointer[i]);
-}
-
-void writeToBuffer(Buffer* buffer, std::string const& value) {
-  for (unsigned i = 0; i < value.size(); ++i)
-    buffer->push_back(value[i]);
-
-  buffer->push_back('\0');
-}
-
-void writeToBuffer(Buffer* buffer, Buffer const* value) {
-  for (unsigned int i = 0; i < value->size(); ++i)
-    buffer->push_back(value->at(i));
-}
-
 static void print_abs_bits(struct libevdev* dev, int axis) {
   const struct input_absinfo* abs;
 
@@ -171,110 +100,6 @@ static void print_bits(struct libevdev* dev) {
   }
 }
 
-void writeCodeBits(struct libevdev* dev,
-                   unsigned int type,
-                   unsigned int max,
-                   Buffer* buffer) {
-  unsigned int i;
-
-  for (i = 0; i <= max; i++) {
-    if (!libevdev_has_event_code(dev, type, i)) {
-      continue;
-    }
-
-    writeToBuffer(buffer, i);
-  }
-}
-
-void gatherInfo(unsigned const& number, struct libevdev* dev) {
-  std::string deviceName;
-  const char* deviceNameChars = libevdev_get_name(dev);
-
-  if (deviceNameChars != 0) {
-    deviceName = deviceNameChars;
-  }
-
-  deviceName += " KH" + std::to_string(number);
-
-  std::string devicePhys;
-  const char* devicePhysChars = libevdev_get_phys(dev);
-
-  if (devicePhysChars != 0) {
-    devicePhys = devicePhysChars;
-  }
-
-  const int deviceIdBusType = libevdev_get_id_bustype(dev);
-
-  const int deviceIdVendor = libevdev_get_id_vendor(dev);
-
-  const int deviceIdProduct = libevdev_get_id_product(dev);
-
-  const int deviceIdVersion = libevdev_get_id_version(dev);
-
-  writeToBuffer(&deviceInfo, (unsigned)number);
-  writeToBuffer(&deviceInfo, (unsigned)deviceName.size() + 1);
-  writeToBuffer(&deviceInfo, deviceName);
-  writeToBuffer(&deviceInfo, (unsigned)devicePhys.size() + 1);
-  writeToBuffer(&deviceInfo, devicePhys);
-  writeToBuffer(&deviceInfo, deviceIdBusType);
-  writeToBuffer(&deviceInfo, deviceIdVendor);
-  writeToBuffer(&deviceInfo, deviceIdProduct);
-  writeToBuffer(&deviceInfo, deviceIdVersion);
-}
-
-void gatherEvents(struct libevdev* dev) {
-  unsigned int i;
-
-  std::vector<Buffer*> buffers;
-
-  for (i = 0; i <= EV_MAX; i++) {
-    if (!libevdev_has_event_type(dev, i)) {
-      continue;
-    }
-
-    Buffer* buffer = new Buffer();
-
-    switch (i) {
-    case EV_KEY:
-      writeCodeBits(dev, EV_KEY, KEY_MAX, buffer);
-      break;
-
-    case EV_REL:
-      writeCodeBits(dev, EV_REL, REL_MAX, buffer);
-      break;
-
-    case EV_ABS:
-      writeCodeBits(dev, EV_ABS, ABS_MAX, buffer);
-      break;
-
-    case EV_LED:
-      writeCodeBits(dev, EV_LED, LED_MAX, buffer);
-      break;
-    }
-
-    unsigned int size = buffer->size();
-    Buffer* newBuffer = new Buffer();
-    writeToBuffer(newBuffer, i);
-    writeToBuffer(newBuffer, size);
-    writeToBuffer(newBuffer, buffer);
-    buffers.push_back(newBuffer);
-    delete buffer;
-  }
-
-  unsigned int size = 0;
-
-  for (auto& buffer : buffers)
-    size += buffer->size();
-
-  writeToBuffer(&deviceInfo, size);
-
-  for (auto& buffer : buffers)
-    writeToBuffer(&deviceInfo, buffer);
-
-  for (auto& buffer : buffers)
-    delete buffer;
-}
-
 static void print_props(struct libevdev* dev) {
   unsigned int i;
   printf("Properties:\n");
@@ -312,108 +137,8 @@ static int print_sync_event(struct input_event* event) {
   return 0;
 }
 
-const char* outputDeviceName1 = KEYBOARD_HOOK_WRITER_DEVICE_INFO_BUFFER_DEVICE_PATH;
-
-const char* outputDeviceName2 = KEYBOARD_HOOK_WRITER_INPUT_KEYBOARD_DEVICE_PATH;
-
-int outpuDeviceFileDescriptor1 = -1;
-int outpuDeviceFileDescriptor2 = -1;
-
-bool openOutputDevice() {
-  outpuDeviceFileDescriptor1 = open(outputDeviceName1, O_WRONLY | O_SYNC);
-
-  if (outpuDeviceFileDescriptor1 <= 0) {
-    logError("Failed to open %s", outputDeviceName1);
-
-    return false;
-  }
-
-  return true;
-}
-
-int sendDeviceInfo(unsigned const& device_number) {
-  int result = write(
-    outpuDeviceFileDescriptor1, deviceInfo.data(), sizeof(char) * deviceInfo.size());
-
-  if (result < 0) {
-    logError("Failed to write the device info");
-
-    return result;
-  }
-
-  result = close(outpuDeviceFileDescriptor1);
-
-  if (result < 0) {
-    logError("Failed to submit the device info");
-
-    return result;
-  }
-
-  std::string output_device_name(outputDeviceName2);
-  output_device_name += std::to_string(device_number);
-
-  outpuDeviceFileDescriptor2 = open(output_device_name.c_str(), O_WRONLY);
-
-  if (outpuDeviceFileDescriptor2 <= 0) {
-    logError("Failed to open %s", output_device_name.c_str());
-
-    return -1;
-  }
-
-  return 0;
-}
-
-int writeEvent(struct input_event* event) {
-  int result
-    = write(outpuDeviceFileDescriptor2, (void*)event, sizeof(struct input_event));
-
-  if (result == 0) {
-    logInfo("0 was written even %ld %ld", (void*)event, sizeof(struct input_event));
-  }
-
-  if (result < 0) {
-    logError("Failed to write an event");
-
-    return result;
-  }
-
-  return 0;
-}
-
-bool _isInputDeviceGrabbed = false;
-
-int sendEvent(struct input_event* event, bool useFnAsWindowKey) {
-  if (!_isInputDeviceGrabbed) {
-    return 0;
-  }
-
-  handleEvent(event, useFnAsWindowKey);
-
-  int result = 0;
-
-  if (_isEventHandled) {
-    int i = 0;
-
-    for (auto& queueEvent : _eventQueue) {
-      i++;
-      result = writeEvent(&queueEvent);
-
-      if (result != 0) {
-        break;
-      }
-    }
-
-    _eventQueue.clear();
-    _isEventHandled = false;
-  } else {
-    result = writeEvent(event);
-  }
-
-  return result;
-}
-
 void viewDevices() {
-  for (int i = 0; i < 32; ++i) {
+  for (unsigned i : KeyboardHook::Reader::findDevices()) {
     std::string devicePath = "/dev/input/event" + std::to_string(i);
     struct libevdev* dev = NULL;
     int fd;
@@ -451,7 +176,11 @@ void viewDevices() {
 
     deviceName = devicePath + " | " + deviceName + " | " + deviceUId + " | " + devicePhys;
 
-    logInfo(deviceName.data());
+    logInfo("%s | bustype=0x%x vendor=0x%x product=0x%x",
+            deviceName.data(),
+            libevdev_get_id_bustype(dev),
+            libevdev_get_id_vendor(dev),
+            libevdev_get_id_product(dev));
 
     libevdev_free(dev);
   }
@@ -541,126 +270,275 @@ void viewEvents(std::string const& devicePath) {
   libevdev_free(dev);
 }
 
-struct libevdev* InputDevice = NULL;
+static volatile sig_atomic_t isRecordingStopped = 0;
+
+static void stopRecording(int) {
+  isRecordingStopped = 1;
+}
 
-void releaseDevices() {
-  if (outpuDeviceFileDescriptor2 > 0) {
-    close(outpuDeviceFileDescriptor2);
+void recordEvents(unsigned number, std::string const& tracePath) {
+  std::string devicePath = KEYBOARD_HOOK_WRITER_INPUT_KEYBOARD_DEVICE_MASTER;
+  devicePath += std::to_string(number);
+
+  int fd = open(devicePath.c_str(), O_RDONLY);
+  struct libevdev* dev = NULL;
+
+  if (fd < 0 || libevdev_new_from_fd(fd, &dev) < 0) {
+    logError("Failed to open %s", devicePath.c_str());
+
+    if (fd >= 0) {
+      close(fd);
+    }
+
+    return;
   }
 
-  // libevdev_grab(InputDevice, LIBEVDEV_UNGRAB);
-  libevdev_free(InputDevice);
-}
+  KeyboardHook::Reader::TraceDevice device = {};
+  device.number = number;
+  device.bustype = libevdev_get_id_bustype(dev);
+  device.vendor = libevdev_get_id_vendor(dev);
+  device.product = libevdev_get_id_product(dev);
+  device.version = libevdev_get_id_version(dev);
+  strncpy(device.name, libevdev_get_name(dev), sizeof(device.name) - 1);
+
+  // Replaying creates the virtual keyboard of the device from it
+  std::vector<unsigned char> descriptor;
+  bool isDescribed = KeyboardHook::Reader::describeDevice(number, fd, dev, &descriptor);
+
+  libevdev_free(dev);
+
+  if (!isDescribed) {
+    close(fd);
+
+    return;
+  }
+
+  // Timestamps that do not jump with the wall clock
+  int clock = CLOCK_MONOTONIC;
+  ioctl(fd, EVIOCSCLOCKID, &clock);
+
+  KeyboardHook::Reader::TraceWriter trace;
+
+  if (!trace.open(tracePath, {device}, {descriptor})) {
+    close(fd);
 
-int grabInputDevice() {
-  if (_isInputDeviceGrabbed) {
-    return 0;
+    return;
   }
 
-  int err = libevdev_grab(InputDevice, LIBEVDEV_GRAB);
+  // Interrupts the read instead of restarting it, the trace is flushed then
+  struct sigaction action = {};
+  action.sa_handler = stopRecording;
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+
+  logInfo("Recording %s (%s) to %s", devicePath.c_str(), device.name, tracePath.c_str());
 
-  if (err != 0) {
-    logError("Failed to grab input device");
+  struct input_event events[64];
+  bool isWritten = true;
 
-    return err;
+  while (isWritten && !isRecordingStopped) {
+    ssize_t size = read(fd, events, sizeof(events));
+
+    if (size < 0 && errno == EINTR) {
+      continue;
+    }
+
+    if (size <= 0) {
+      logError("Failed to read %s", devicePath.c_str());
+
+      break;
+    }
+
+    for (ssize_t i = 0; isWritten && i < size / (ssize_t)sizeof(events[0]); ++i) {
+      isWritten = trace.append(0, events[i]);
+    }
   }
 
-  _isInputDeviceGrabbed = true;
+  isWritten = trace.flush() && isWritten;
+  close(fd);
 
-  return 0;
+  if (!isWritten) {
+    logError("The trace is cut off after %llu events",
+             (unsigned long long)trace.recordCount());
+
+    return;
+  }
+
+  logInfo("Recorded %llu events", (unsigned long long)trace.recordCount());
 }
 
-void initializeAndRunForwarding(unsigned device_number, bool useFnAsWindowKey) {
-  gatherInfo(device_number, InputDevice);
-  gatherEvents(InputDevice);
+// Numbers past those of the /dev/input/eventN nodes, the virtual keyboards of
+// a replay are registered in the writer under them
+static unsigned const replayDeviceNumberBase = 1024;
+
+void replayTrace(std::string const& tracePath,
+                 std::string const& outputPath,
+                 std::string const& configPath,
+                 bool isTimed) {
+  using namespace KeyboardHook::Reader;
+
+  struct Replayed {
+    explicit Replayed(unsigned number) : device(number) {}
 
-  if (!openOutputDevice()) {
+    Device device;
+    EventHandler handler;
+    FrameBuffer frame;
+  };
+
+  TraceFile trace;
+  KeymapConfig config;
+
+  if (!trace.open(tracePath)
+      || (access(configPath.c_str(), F_OK) == 0 && !config.load(configPath))) {
     return;
   }
 
-  if (sendDeviceInfo(device_number) != 0) {
+  std::vector<TraceDevice> devices;
+  std::vector<std::vector<unsigned char>> descriptors;
+  std::vector<std::unique_ptr<Replayed>> replayed;
+
+  for (std::size_t i = 0; i < trace.deviceCount(); ++i) {
+    TraceDevice device = trace.device(i);
+    DeviceIdentity identity;
+
+    device.name[sizeof(device.name) - 1] = '\0';
+    identity.name = device.name;
+    identity.bustype = device.bustype;
+    identity.vendor = device.vendor;
+    identity.product = device.product;
+
+    devices.push_back(device);
+    descriptors.push_back(trace.descriptor(i));
+    replayed.emplace_back(new Replayed(replayDeviceNumberBase + i));
+    replayed.back()->handler.setKeymap(config.compile(identity));
+
+    // The virtual keyboard the device had when it was recorded
+    if (!replayed.back()->device.attach(descriptors.back())) {
+      return;
+    }
+  }
+
+  TraceWriter output;
+
+  if (!outputPath.empty() && !output.open(outputPath, devices, descriptors)) {
     return;
   }
 
-  // viewDevices();
-  // std::thread thread2(viewEvents);
+  // Frames are injected by the device as forwarded ones are, and written to
+  // the output trace along the way
+  std::uint64_t sentCount = 0;
+  bool isFailed = false;
+  auto flush = [&](std::uint16_t index) {
+    FrameBuffer& frame = replayed[index]->frame;
 
-  int rc = 0;
+    if (frame.empty()) {
+      return 0;
+    }
 
-  do {
-    struct input_event event;
-    rc = libevdev_next_event(
-      InputDevice, LIBEVDEV_READ_FLAG_NORMAL | LIBEVDEV_READ_FLAG_BLOCKING, &event);
+    sentCount += frame.size();
+    isFailed = isFailed || !replayed[index]->device.inject(frame.data(), frame.size());
 
-    if (event.type == EV_SYN) {
-      if (grabInputDevice() != 0) {
-        return;
-      }
+    for (std::size_t i = 0; !outputPath.empty() && i < frame.size(); ++i) {
+      isFailed = isFailed || !output.append(index, frame.data()[i]);
     }
 
-    if (rc == LIBEVDEV_READ_STATUS_SYNC) {
-      while (rc == LIBEVDEV_READ_STATUS_SYNC) {
-        if (sendEvent(&event, useFnAsWindowKey) != 0) {
-          return;
-        }
+    frame.clear();
 
-        rc = libevdev_next_event(InputDevice, LIBEVDEV_READ_FLAG_SYNC, &event);
-      }
+    return isFailed ? -1 : 0;
+  };
 
-      if (rc == -EAGAIN) {
-        continue;
-      }
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
 
-      if (sendEvent(&event, useFnAsWindowKey) != 0) {
-        return;
-      }
-    } else if (rc == LIBEVDEV_READ_STATUS_SUCCESS) {
-      if (sendEvent(&event, useFnAsWindowKey) != 0) {
-        return;
+  std::int64_t const startTime = (std::int64_t)start.tv_sec * 1000000000 + start.tv_nsec;
+  std::int64_t const firstTime = trace.recordCount() > 0 ? trace.records()[0].time : 0;
+  std::size_t replayedCount = 0;
+
+  for (std::size_t i = 0; !isFailed && i < trace.recordCount(); ++i) {
+    TraceRecord const& record = trace.records()[i];
+
+    if (record.device >= replayed.size()) {
+      continue;
+    }
+
+    if (isTimed) {
+      std::int64_t time = startTime + (record.time - firstTime);
+      struct timespec deadline = {(time_t)(time / 1000000000), (long)(time % 1000000000)};
+
+      while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR) {
       }
     }
-  } while (rc == LIBEVDEV_READ_STATUS_SYNC || rc == LIBEVDEV_READ_STATUS_SUCCESS
-           || rc == -EAGAIN);
 
-  if (rc != LIBEVDEV_READ_STATUS_SUCCESS && rc != -EAGAIN) {
-    fprintf(stderr, "Failed to handle events: %s\n", strerror(-rc));
-  }
+    Replayed& device = *replayed[record.device];
+    struct input_event event;
 
-  // thread2.join();
-}
+    event.time = fromTraceTime(record.time);
+    event.type = record.type;
+    event.code = record.code;
+    event.value = record.value;
 
-void handleEvents(unsigned device_number,
-                  std::string const& devicePath,
-                  bool useFnAsWindowKey) {
-  int fd;
-  fd = open(devicePath.c_str(), O_RDONLY);
+    forwardEvent(&device.handler, &device.frame, &event, [&]() {
+      return flush(record.device);
+    });
 
-  int err;
-  InputDevice = libevdev_new();
+    ++replayedCount;
+  }
+
+  for (std::size_t i = 0; i < replayed.size(); ++i) {
+    flush(i);
+  }
+
+  if ((!outputPath.empty() && !output.flush()) || isFailed) {
+    logError("The replay stopped after %zu events", replayedCount);
 
-  if (!InputDevice) {
     return;
   }
 
-  err = libevdev_set_fd(InputDevice, fd);
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
 
-  if (err < 0) {
-    printf("Failed to open input device (errno %d): %s\n", -err, strerror(-err));
+  double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
 
+  logInfo("Replayed %zu events in %.3f s (%.0f events/s), %llu events sent",
+          replayedCount,
+          elapsed,
+          elapsed > 0 ? replayedCount / elapsed : 0,
+          (unsigned long long)sentCount);
+}
+
+// Enters real time just before forwarding, the threads started until then
+// keep the ordinary scheduler
+static void enterRealtime(KeyboardHook::Reader::Daemon& daemon,
+                          KeyboardHook::Reader::RealtimeOptions const& realtime) {
+  daemon.setMaxSpin(realtime.maxSpin);
+
+  if (!realtime.isEnabled) {
     return;
   }
 
-  initializeAndRunForwarding(device_number, useFnAsWindowKey);
-
-  releaseDevices();
+  if (KeyboardHook::Reader::enterRealtime(realtime) && daemon.checkEventPaths()) {
+    logInfo("The event path neither faults nor allocates");
+  }
 }
 
-void setupHook(int device, bool doShowEvent, bool useFnAsWindowKey) {
-  // For some reason it is required otherwise you will get empty (0) events at
-  // the first run
-  _eventQueue.reserve(9);
-  _isEventHandled = false;
+void handleEvents(unsigned device_number,
+                  std::string const& configPath,
+                  KeyboardHook::Reader::RealtimeOptions const& realtime) {
+  AsyncLogging const logging;
+  KeyboardHook::Reader::Daemon daemon(configPath);
 
+  if (!daemon.loadConfig() || !daemon.watchSignals() || !daemon.addDevice(device_number)) {
+    return;
+  }
+
+  enterRealtime(daemon, realtime);
+  daemon.run();
+}
+
+void setupHook(int device,
+               bool doShowEvent,
+               std::string const& configPath,
+               KeyboardHook::Reader::RealtimeOptions const& realtime) {
   if (device < 0) {
     viewDevices();
   } else {
@@ -670,9 +548,39 @@ void setupHook(int device, bool doShowEvent, bool useFnAsWindowKey) {
     if (doShowEvent) {
       viewEvents(devicePath);
     } else {
-      handleEvents(device, devicePath, useFnAsWindowKey);
+      handleEvents(device, configPath, realtime);
     }
   }
 
   // std::thread thread(viewEvents);
 }
+
+void runDaemon(std::string const& configPath,
+               bool takeOver,
+               KeyboardHook::Reader::RealtimeOptions const& realtime) {
+  // Outlives the daemon and its threads, so that nothing logs after it
+  AsyncLogging const logging;
+  KeyboardHook::Reader::Daemon daemon(configPath);
+
+  if (!daemon.loadConfig() || !daemon.watchSignals() || !daemon.watchDevices()
+      || !daemon.watchConfig()) {
+    return;
+  }
+
+  // Without --takeover a daemon still running (one started outside the
+  // service, say) is taken over all the same, rather than fought for the
+  // devices
+  if (!daemon.takeOver(takeOver)) {
+    return;
+  }
+
+  // The daemon forwards without its metrics all the same
+  daemon.serveMetrics();
+
+  // Keyboards the running daemon did not hook yet are hooked as usual
+  daemon.addKeyboards();
+  daemon.listenForHandoff();
+  KeyboardHook::Reader::notifyService("READY=1");
+  enterRealtime(daemon, realtime);
+  daemon.run();
+}
@@ -1,3 +1,18 @@
 #pragma once
 
-void setupHook(int, bool, bool);
+#include <string>
+
+#include "realtime.hpp"
+
+void setupHook(int,
+               bool,
+               std::string const&,
+               KeyboardHook::Reader::RealtimeOptions const&);
+
+void runDaemon(std::string const&,
+               bool,
+               KeyboardHook::Reader::RealtimeOptions const&);
+
+void recordEvents(unsigned, std::string const&);
+
+void replayTrace(std::string const&, std::string const&, std::string const&, bool);
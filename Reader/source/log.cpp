@@ -0,0 +1,276 @@
+#include "log.hpp"
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdarg>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+std::size_t const logRecordTextSize = 240;
+
+// Messages a thread has in flight before dropping more
+std::uint32_t const logRingCapacity = 256;
+
+// A thread logs a burst of this many messages, then this many per second
+double const logBurst = 100;
+double const logRate = 50;
+
+// How often the count of dropped messages is reported at most
+int const dropReportMilliseconds = 1000;
+
+struct LogRecord {
+  char const* level;
+  char text[logRecordTextSize];
+};
+
+// Messages of a single thread, it is the only producer and the logging thread
+// the only consumer
+struct LogRing {
+  LogRing() : head(0), tail(0), isAbandoned(false), tokens(logBurst), refillTime(0) {}
+
+  std::atomic<std::uint32_t> head;
+  std::atomic<std::uint32_t> tail;
+  // Set once the thread is gone, the ring is freed after its last message
+  std::atomic<bool> isAbandoned;
+  std::array<LogRecord, logRingCapacity> records;
+  // Rate limit, touched by the producer alone
+  double tokens;
+  std::int64_t refillTime;
+};
+
+std::atomic<bool> isAsync(false);
+std::atomic<std::uint64_t> droppedCount(0);
+int wakeFileDescriptor = -1;
+std::thread loggingThread;
+
+// Guards the list only, taken once per thread and by the logging thread
+std::mutex ringsMutex;
+std::vector<LogRing*> rings;
+
+struct RingHolder {
+  LogRing* ring = nullptr;
+
+  ~RingHolder() {
+    if (ring != nullptr) {
+      ring->isAbandoned.store(true, std::memory_order_release);
+    }
+  }
+};
+
+thread_local RingHolder ringHolder;
+
+std::int64_t coarseMilliseconds() {
+  struct timespec time;
+
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &time);
+
+  return (std::int64_t)time.tv_sec * 1000 + time.tv_nsec / 1000000;
+}
+
+LogRing* threadRing() {
+  if (ringHolder.ring == nullptr) {
+    ringHolder.ring = new LogRing();
+
+    std::lock_guard<std::mutex> lock(ringsMutex);
+
+    rings.push_back(ringHolder.ring);
+  }
+
+  return ringHolder.ring;
+}
+
+bool takeToken(LogRing* ring) {
+  std::int64_t const now = coarseMilliseconds();
+
+  ring->tokens = std::min(logBurst, ring->tokens + (now - ring->refillTime) * logRate / 1000);
+  ring->refillTime = now;
+
+  if (ring->tokens < 1) {
+    return false;
+  }
+
+  ring->tokens -= 1;
+
+  return true;
+}
+
+void writeAll(std::string const& text) {
+  for (std::size_t written = 0; written < text.size();) {
+    ssize_t result = write(STDOUT_FILENO, text.data() + written, text.size() - written);
+
+    if (result <= 0) {
+      return;
+    }
+
+    written += result;
+  }
+}
+
+void appendLine(std::string* text, char const* level, char const* message) {
+  *text += '[';
+  *text += level;
+  *text += "] ";
+  *text += message;
+  *text += '\n';
+}
+
+// Takes the messages of every thread, frees the rings of threads that are gone
+void drainRings(std::string* text) {
+  std::lock_guard<std::mutex> lock(ringsMutex);
+
+  for (auto ring = rings.begin(); ring != rings.end();) {
+    bool const isAbandoned = (*ring)->isAbandoned.load(std::memory_order_acquire);
+    std::uint32_t const head = (*ring)->head.load(std::memory_order_acquire);
+    std::uint32_t tail = (*ring)->tail.load(std::memory_order_relaxed);
+
+    for (; tail != head; ++tail) {
+      LogRecord const& record = (*ring)->records[tail % logRingCapacity];
+
+      appendLine(text, record.level, record.text);
+    }
+
+    (*ring)->tail.store(tail, std::memory_order_release);
+
+    if (isAbandoned) {
+      delete *ring;
+      ring = rings.erase(ring);
+    } else {
+      ++ring;
+    }
+  }
+}
+
+void runLogging() {
+  std::uint64_t reportedDroppedCount = 0;
+  std::int64_t reportTime = 0;
+  std::string text;
+
+  while (true) {
+    struct pollfd descriptor = {wakeFileDescriptor, POLLIN, 0};
+    eventfd_t value;
+
+    poll(&descriptor, 1, dropReportMilliseconds);
+    eventfd_read(wakeFileDescriptor, &value);
+
+    bool const isStopped = !isAsync.load(std::memory_order_acquire);
+
+    text.clear();
+    drainRings(&text);
+
+    std::uint64_t const dropped = droppedCount.load(std::memory_order_relaxed);
+    std::int64_t const now = coarseMilliseconds();
+
+    if (dropped != reportedDroppedCount
+        && (isStopped || now - reportTime >= dropReportMilliseconds)) {
+      appendLine(&text,
+                 "WARN",
+                 ("Dropped " + std::to_string(dropped - reportedDroppedCount)
+                  + " log messages")
+                   .c_str());
+
+      reportedDroppedCount = dropped;
+      reportTime = now;
+    }
+
+    writeAll(text);
+
+    if (isStopped) {
+      return;
+    }
+  }
+}
+} // namespace
+
+void logLog(char const* msg, char const* format, va_list args) {
+  if (!isAsync.load(std::memory_order_acquire)) {
+    fprintf(stdout, "[%s] ", msg);
+    vfprintf(stdout, format, args);
+    fprintf(stdout, "\n");
+
+    return;
+  }
+
+  LogRing* ring = threadRing();
+  std::uint32_t const head = ring->head.load(std::memory_order_relaxed);
+  std::uint32_t const tail = ring->tail.load(std::memory_order_acquire);
+
+  if (head - tail == logRingCapacity || !takeToken(ring)) {
+    droppedCount.fetch_add(1, std::memory_order_relaxed);
+
+    return;
+  }
+
+  LogRecord& record = ring->records[head % logRingCapacity];
+
+  // Formatted here, the arguments do not outlive the call
+  record.level = msg;
+  vsnprintf(record.text, sizeof(record.text), format, args);
+
+  ring->head.store(head + 1, std::memory_order_release);
+
+  // The logging thread is woken for the first message it has not seen yet
+  if (head == tail) {
+    eventfd_write(wakeFileDescriptor, 1);
+  }
+}
+
+void logInfo(char const* format, ...) {
+  va_list args;
+  va_start(args, format);
+  logLog("INFO", format, args);
+  va_end(args);
+}
+
+void log_warn(char const* format, ...) {
+  va_list args;
+  va_start(args, format);
+  logLog("WARN", format, args);
+  va_end(args);
+}
+
+void logError(char const* format, ...) {
+  va_list args;
+  va_start(args, format);
+  logLog("ERROR", format, args);
+  va_end(args);
+}
+
+std::uint64_t droppedLogCount() {
+  return droppedCount.load(std::memory_order_relaxed);
+}
+
+AsyncLogging::AsyncLogging() {
+  wakeFileDescriptor = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+  if (wakeFileDescriptor < 0) {
+    return;
+  }
+
+  // Whatever was written synchronously goes first
+  fflush(stdout);
+
+  isAsync.store(true, std::memory_order_release);
+  loggingThread = std::thread(runLogging);
+}
+
+AsyncLogging::~AsyncLogging() {
+  if (!loggingThread.joinable()) {
+    return;
+  }
+
+  isAsync.store(false, std::memory_order_release);
+  eventfd_write(wakeFileDescriptor, 1);
+  loggingThread.join();
+
+  // The descriptor is left open, a thread outliving this may still ring it
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstdint>
+
+void logInfo(char const* format, ...) __attribute__((format(printf, 1, 2)));
+
+void log_warn(char const* format, ...) __attribute__((format(printf, 1, 2)));
+
+void logError(char const* format, ...) __attribute__((format(printf, 1, 2)));
+
+// Messages lost to the rate limit or to a full ring
+std::uint64_t droppedLogCount();
+
+// While alive, messages are formatted into a ring of the calling thread and
+// written out by a thread of their own, so that a slow stdout (a pipe to the
+// journal) never holds up the caller. Without it they are written right away.
+class AsyncLogging {
+public:
+  AsyncLogging();
+
+  AsyncLogging(AsyncLogging const&) = delete;
+
+  // Writes out whatever is left
+  ~AsyncLogging();
+
+  AsyncLogging& operator=(AsyncLogging const&) = delete;
+};
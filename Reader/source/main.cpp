@@ -10,7 +10,24 @@ int main(int argc, char* argv[]) {
   po::options_description desc("Allowed options");
   desc.add_options()("help,h", "Displays help")("print,p", "print input devices")(
     "input,i", po::value<int>(), "specify input device")(
-    "fnwin,f", po::value<int>(), "use fn as window key");
+    "fnwin,f", po::value<int>(), "use fn as window key (ignored)")(
+    "daemon,d", "hook all keyboards in a single process")(
+    "takeover,t", "take the keyboards over from the running daemon (implies -d)")(
+    "record,r", po::value<std::string>(), "record the events of the input device to a trace")(
+    "replay",
+    po::value<std::string>(),
+    "replay a trace through the keymap into the writer")(
+    "output,o", po::value<std::string>(), "trace the replayed events are written to")(
+    "timed", "replay at the recorded timing instead of as fast as possible")(
+    "realtime", "forward on SCHED_FIFO with the memory locked")(
+    "priority", po::value<int>()->default_value(50), "SCHED_FIFO priority of --realtime")(
+    "cpu", po::value<int>()->default_value(-1), "CPU --realtime forwards on")(
+    "spin",
+    po::value<unsigned>()->default_value(0),
+    "microseconds to poll for the next key of a burst before sleeping")(
+    "config,c",
+    po::value<std::string>()->default_value("/etc/keyboard-hook.conf"),
+    "keymap configuration file");
 
   po::variables_map vm;
   po::store(po::parse_command_line(argc, argv, desc), vm);
@@ -18,7 +35,6 @@ int main(int argc, char* argv[]) {
 
   int device = -1;
   bool print_events_option = false;
-  bool use_fn_as_super_key = false;
 
   if (vm.count("help")) {
     std::cout << "If no arguments are provided will show available devices to replace"
@@ -37,13 +53,46 @@ int main(int argc, char* argv[]) {
       device = vm["input"].as<int>();
       print_events_option = true;
     }
+  }
+
+  std::string const config_path = vm["config"].as<std::string>();
+
+  KeyboardHook::Reader::RealtimeOptions realtime;
+  realtime.isEnabled = vm.count("realtime") > 0;
+  realtime.priority = vm["priority"].as<int>();
+  realtime.cpu = vm["cpu"].as<int>();
+  realtime.maxSpin = vm["spin"].as<unsigned>();
+
+  if (vm.count("replay")) {
+    std::string const output_path
+      = vm.count("output") ? vm["output"].as<std::string>() : std::string();
+
+    replayTrace(vm["replay"].as<std::string>(),
+                output_path,
+                config_path,
+                vm.count("timed") > 0);
+
+    return 0;
+  }
 
-    if (vm.count("fnwin")) {
-      use_fn_as_super_key = true;
+  if (vm.count("record")) {
+    if (device < 0) {
+      std::cerr << "Recording requires an input device (-i)" << std::endl;
+      return 1;
     }
+
+    recordEvents(device, vm["record"].as<std::string>());
+
+    return 0;
+  }
+
+  if (vm.count("daemon") || vm.count("takeover")) {
+    runDaemon(config_path, vm.count("takeover") > 0, realtime);
+
+    return 0;
   }
 
-  setupHook(device, print_events_option, use_fn_as_super_key);
+  setupHook(device, print_events_option, config_path, realtime);
 
   return 0;
 }
@@ -0,0 +1,155 @@
+#include "realtime.hpp"
+
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include <cerrno>
+#include <cstring>
+
+#include "EventHandler.hpp"
+#include "FrameBuffer.hpp"
+#include "allocation.hpp"
+#include "log.hpp"
+
+namespace KeyboardHook {
+namespace Reader {
+// Stack the forwarding thread is expected to use at most
+static std::size_t const prefaultStackSize = 256 * 1024;
+
+static cpu_set_t _processCpus;
+static bool _isProcessCpusSaved = false;
+
+static void prefaultStack() {
+  char stack[prefaultStackSize];
+
+  std::memset(stack, 0, sizeof(stack));
+
+  // Keeps the stores from being optimized away
+  __asm__ __volatile__("" : : "r"(stack) : "memory");
+}
+
+static long pageFaultCount() {
+  struct rusage usage;
+
+  getrusage(RUSAGE_THREAD, &usage);
+
+  return usage.ru_minflt + usage.ru_majflt;
+}
+
+bool enterRealtime(RealtimeOptions const& options) {
+  bool isEntered = true;
+
+  // Freed memory stays mapped (and locked) for the next allocation
+  mallopt(M_TRIM_THRESHOLD, -1);
+  mallopt(M_MMAP_MAX, 0);
+
+  if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+    logError("Failed to lock the memory: %s", strerror(errno));
+
+    isEntered = false;
+  }
+
+  prefaultStack();
+
+  if (pthread_getaffinity_np(pthread_self(), sizeof(_processCpus), &_processCpus) == 0) {
+    _isProcessCpusSaved = true;
+  }
+
+  if (options.cpu >= 0) {
+    cpu_set_t cpus;
+
+    CPU_ZERO(&cpus);
+    CPU_SET(options.cpu, &cpus);
+
+    int error = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+
+    if (error != 0) {
+      logError("Failed to pin to CPU %d: %s", options.cpu, strerror(error));
+
+      isEntered = false;
+    }
+  }
+
+  struct sched_param parameters = {};
+  parameters.sched_priority = options.priority;
+
+  int error = pthread_setschedparam(pthread_self(), SCHED_FIFO, &parameters);
+
+  if (error != 0) {
+    logError("Failed to run on SCHED_FIFO %d: %s", options.priority, strerror(error));
+
+    isEntered = false;
+  }
+
+  if (isEntered) {
+    logInfo("Forwarding on SCHED_FIFO %d, CPU %d, memory locked",
+            options.priority,
+            options.cpu);
+  }
+
+  return isEntered;
+}
+
+void leaveRealtime() {
+  struct sched_param parameters = {};
+
+  pthread_setschedparam(pthread_self(), SCHED_OTHER, &parameters);
+
+  if (_isProcessCpusSaved) {
+    pthread_setaffinity_np(pthread_self(), sizeof(_processCpus), &_processCpus);
+  }
+}
+
+bool checkEventPath(std::shared_ptr<Keymap const> const& keymap) {
+  EventHandler handler;
+  FrameBuffer frame;
+  struct input_event event = {};
+
+  handler.setKeymap(keymap);
+
+  long faults = 0;
+  unsigned long long allocations = 0;
+
+  // The frames are dropped where they would be injected
+  auto flush = [&frame]() {
+    frame.clear();
+
+    return 0;
+  };
+
+  // The first pass brings the code and the tables in, the second one is checked
+  for (int pass = 0; pass < 2; ++pass) {
+    AllocationCounter counter;
+
+    faults = pageFaultCount();
+
+    for (__s32 value : {1, 2, 0}) {
+      for (KeyCode code = 0; code < KEY_CNT; ++code) {
+        event.type = EV_KEY;
+        event.code = code;
+        event.value = value;
+
+        forwardEvent(&handler, &frame, &event, flush);
+      }
+    }
+
+    faults = pageFaultCount() - faults;
+    allocations = counter.count();
+  }
+
+  if (faults != 0 || allocations != 0) {
+    logError("The event path faulted in %ld pages and allocated %llu times",
+             faults,
+             allocations);
+
+    return false;
+  }
+
+  return true;
+}
+} // namespace Reader
+} // namespace KeyboardHook
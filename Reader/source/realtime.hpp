@@ -0,0 +1,33 @@
+#pragma once
+
+#include <memory>
+
+#include "Keymap.hpp"
+
+namespace KeyboardHook {
+namespace Reader {
+struct RealtimeOptions {
+  bool isEnabled;
+  // SCHED_FIFO priority of the forwarding thread
+  int priority;
+  // CPU the forwarding thread is pinned to, -1 for any
+  int cpu;
+  // Longest the forwarding thread polls for the next event of a burst, in
+  // microseconds, on the ordinary scheduler as well. 0 never polls.
+  unsigned maxSpin;
+};
+
+// Puts the calling thread on SCHED_FIFO (and the CPU), locks all the memory of
+// the process and faults in its stack, so that a key event waits neither for
+// other processes nor for pages. Returns false if any of it failed.
+bool enterRealtime(RealtimeOptions const& options);
+
+// Back to the ordinary scheduler on any CPU, for the threads started by the
+// forwarding thread that are not to compete with it
+void leaveRealtime();
+
+// Runs synthetic events through the remapping of the keymap, returns false
+// (and logs why) if that faulted in pages or allocated
+bool checkEventPath(std::shared_ptr<Keymap const> const& keymap);
+} // namespace Reader
+} // namespace KeyboardHook
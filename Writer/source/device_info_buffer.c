@@ -4,19 +4,15 @@
 
 #define KEYBOARD_HOOK_WRITER_DEVICE_INFO_BUFFER_DEVICE_NAME "keyboard_hook_writer_device_info_buffer"
 
-struct device_info_buffer* device_info_buffer;
+/* Largest descriptor accepted, a descriptor is a few hundred bytes */
+#define KEYBOARD_HOOK_WRITER_DEVICE_INFO_MAX_SIZE 4096
 
-struct device_info_buffer* get_device_info_buffer(void) {
-    return device_info_buffer;
-}
+struct device_info_buffer* device_info_buffer;
 
 int open_device_info_buffer(struct inode* inode, struct file* filp) {
     unsigned int mj = imajor(inode);
     unsigned int mn = iminor(inode);
-
-    if (mutex_lock_killable(&device_info_buffer->mutex)) {
-        return -EINTR;
-    }
+    struct device_info* info = NULL;
 
     if (mj != device_info_buffer->major || mn != device_info_buffer->minor) {
         printk(KERN_WARNING "[target] "
@@ -31,42 +27,54 @@ int open_device_info_buffer(struct inode* inode, struct file* filp) {
         return -ENODEV; /* No such device */
     }
 
+    info = (struct device_info*)kzalloc(sizeof(struct device_info), GFP_KERNEL);
+
+    if (info == NULL) {
+        return -ENOMEM;
+    }
+
+    filp->private_data = info;
+
     return 0;
 }
 
 ssize_t write_to_device_info_buffer(struct file* filp, const char __user* buf, size_t count, loff_t* f_pos) {
-    ssize_t retval = 0;
+    struct device_info* info = filp->private_data;
+    unsigned char* data = NULL;
 
-    if (device_info_buffer->bufferPosition >= device_info_buffer->buffer_size) {
-        /* Writing beyond the end of the buffer is not allowed. */
-        retval = -EINVAL;
-        goto out;
+    if (count > KEYBOARD_HOOK_WRITER_DEVICE_INFO_MAX_SIZE - info->size) {
+        /* Writing beyond the largest descriptor is not allowed. */
+        return -EINVAL;
     }
 
-    if ((device_info_buffer->bufferPosition + count) >= device_info_buffer->buffer_size) {
-        count = device_info_buffer->buffer_size - device_info_buffer->bufferPosition;
+    /* Grown to the size written, the descriptor is usually written at once */
+    data = (unsigned char*)krealloc(info->data, info->size + count, GFP_KERNEL);
+
+    if (data == NULL) {
+        return -ENOMEM;
     }
 
-    if (copy_from_user(&(device_info_buffer->data[device_info_buffer->bufferPosition]), buf, count) != 0) {
-        retval = -EFAULT;
-        goto out;
+    info->data = data;
+
+    if (copy_from_user(&info->data[info->size], buf, count) != 0) {
+        return -EFAULT;
     }
 
-    device_info_buffer->bufferPosition += count;
-    *f_pos = device_info_buffer->bufferPosition;
-    retval = count;
+    info->size += count;
+    *f_pos = info->size;
 
-out:
-    return retval;
+    return count;
 }
 
 int release_device_info_buffer(struct inode* inode, struct file* filp) {
+    struct device_info* info = filp->private_data;
     int err = create_output_keyboard(device_info_buffer->major,
                                      device_info_buffer->minor + 1,
-                                     device_info_buffer->class);
-    device_info_buffer->bufferPosition = 0;
+                                     device_info_buffer->class,
+                                     info);
 
-    mutex_unlock(&device_info_buffer->mutex);
+    kfree(info->data);
+    kfree(info);
 
     if (err) {
         printk(KERN_WARNING "Failed to create_output_keyboard");
@@ -100,13 +108,9 @@ int create_device_info_buffer(unsigned int major, unsigned int minor, struct cla
 
     BUG_ON(device_info_buffer == NULL || class == NULL);
 
-    /* Memory is to be allocated when the device is opened the first time */
-    device_info_buffer->data = NULL;
-    device_info_buffer->buffer_size = 40000;
     device_info_buffer->major = major;
     device_info_buffer->class = class;
     device_info_buffer->minor = minor;
-    mutex_init(&device_info_buffer->mutex);
 
     cdev_init(&device_info_buffer->cdev, &device_info_buffer_fops);
     device_info_buffer->cdev.owner = THIS_MODULE;
@@ -139,18 +143,6 @@ int create_device_info_buffer(unsigned int major, unsigned int minor, struct cla
         return errror;
     }
 
-    /* allocate the buffer */
-    if (device_info_buffer->data == NULL) {
-        device_info_buffer->data = (unsigned char*)kzalloc(device_info_buffer->buffer_size, GFP_KERNEL);
-
-        if (device_info_buffer->data == NULL) {
-            printk(KERN_WARNING "[target] open(): out of memory\n");
-            return -ENOMEM;
-        }
-    }
-
-    device_info_buffer->bufferPosition = 0;
-
     return 0;
 }
 
@@ -159,6 +151,6 @@ void destroy_device_info_buffer(void) {
     release_all_output_keyboards();
     device_destroy(device_info_buffer->class, MKDEV(device_info_buffer->major, device_info_buffer->minor));
     cdev_del(&device_info_buffer->cdev);
-    kfree(device_info_buffer->data);
+    kfree(device_info_buffer);
     return;
 }
@@ -15,17 +15,18 @@
 #include <asm/uaccess.h>
 
 struct device_info_buffer {
-  unsigned char* data;
-  unsigned long  bufferPosition;
-  unsigned long  buffer_size;
   unsigned int   major;
   unsigned int   minor;
   struct         class*  class;
-  struct mutex   mutex;
   struct cdev    cdev;
 };
 
-struct device_info_buffer* get_device_info_buffer(void);
+/* Descriptor written through a single open of the buffer, every open has its
+ * own so that devices register in parallel */
+struct device_info {
+  unsigned char* data;
+  unsigned long  size;
+};
 
 int create_device_info_buffer(unsigned int  major,
                               unsigned int  minor,
@@ -1,28 +1,34 @@
 #include "input_keyboard.h"
 
+#include "keyboard_hook_writer_uapi.h"
+#include "remap_filter.h"
+
+#include <linux/compat.h>
 #include <linux/input.h>
-#include <linux/list.h>
+#include <linux/mm.h>
+#include <linux/uaccess.h>
+#include <linux/vmalloc.h>
+#include <linux/xarray.h>
 
 #define KEYBOARD_HOOK_WRITER_INPUT_KEYBOARD_DEVICE_NAME \
   "keyboard_hook_writer_input_keyboard"
 
-struct list_entry {
-  struct list_head     list;
+struct keyboard_entry {
   struct input_keyboard device;
 };
 
-static LIST_HEAD(_list);
-
-void release_input_keyboard_routine(struct list_entry* entry);
+/* Keyboards by minor, a keyboard gets the lowest free one */
+static DEFINE_XARRAY_ALLOC(_keyboards);
 
 int open_input_keyboard(struct inode* inode, struct file* filp) {
   unsigned int          mj      = imajor(inode);
   unsigned int          mn      = iminor(inode);
   struct input_keyboard* device = NULL;
-  struct list_entry*     entry  = NULL;
+  struct keyboard_entry*     entry  = NULL;
+  int                    error  = 0;
 
   device = container_of(inode->i_cdev, struct input_keyboard, cdev);
-  entry  = container_of(device, struct list_entry, device);
+  entry  = container_of(device, struct keyboard_entry, device);
 
   if (mj != entry->device.major ||
       mn != entry->device.minor) {
@@ -37,79 +43,205 @@ int open_input_keyboard(struct inode* inode, struct file* filp) {
     return -ENODEV;             /* No such device */
   }
 
+  /* The open holds the node and with it the entry, even if the keyboard was
+   * released since the node was looked up. Only a keyboard still registered
+   * is used past this point. */
+  error = attach_output_keyboard(entry->device.output_device);
+
+  if (error != 0) {
+    return error;
+  }
+
   filp->private_data = entry;
 
-  if (mutex_lock_killable(&entry->device.mutex)) {
-    printk(KERN_ERR "open_input_keyboard: Failed to get lock\n");
-    return -EINTR;
+  /* Not a lock, the file may be passed on and released by another task */
+  if (test_and_set_bit(INPUT_KEYBOARD_IS_OPEN, &entry->device.flags)) {
+    printk(KERN_ERR "open_input_keyboard: Already open\n");
+    detach_output_keyboard(entry->device.output_device);
+    return -EBUSY;
+  }
+
+  entry->device.ring = vmalloc_user(sizeof(struct keyboard_hook_writer_ring));
+
+  if (entry->device.ring == NULL) {
+    printk(KERN_ERR "input_keyboard.c: Not enough memory\n");
+    clear_bit(INPUT_KEYBOARD_IS_OPEN, &entry->device.flags);
+    detach_output_keyboard(entry->device.output_device);
+    return -ENOMEM;
   }
 
   return 0;
 }
 
+int mmap_input_keyboard(struct file* filp, struct vm_area_struct* vma) {
+  struct keyboard_entry* entry = filp->private_data;
+  unsigned long      size  = vma->vm_end - vma->vm_start;
+
+  /* The ring holds events of the layout of the module */
+  if (in_compat_syscall()) {
+    return -EINVAL;
+  }
+
+  if (vma->vm_pgoff != 0
+      || size > PAGE_ALIGN(sizeof(struct keyboard_hook_writer_ring))) {
+    return -EINVAL;
+  }
+
+  if (entry->device.ring == NULL) {
+    return -ENODEV;
+  }
+
+  return remap_vmalloc_range(vma, entry->device.ring, 0);
+}
+
+/* Injects the events appended to the ring since the last doorbell */
+static ssize_t drain_ring(struct input_keyboard* device) {
+  struct keyboard_hook_writer_ring* ring = device->ring;
+  struct input_event                event;
+  __u32                             tail  = 0;
+  __u32                             head  = 0;
+
+  if (ring == NULL) {
+    printk(KERN_ERR "input_keyboard.c: Doorbell without a ring\n");
+    return -ENODEV;
+  }
+
+  tail = ring->tail;
+  head = smp_load_acquire(&ring->head);
+
+  if (head - tail > KEYBOARD_HOOK_WRITER_RING_SIZE) {
+    printk(KERN_ERR "input_keyboard.c: Ring head %u is out of range\n", head);
+    return -EINVAL;
+  }
+
+  for (; tail != head; ++tail) {
+    /* The ring is writable from user space, every event is read once */
+    memcpy(&event,
+           &ring->events[tail & (KEYBOARD_HOOK_WRITER_RING_SIZE - 1)],
+           sizeof(event));
+
+    input_event(device->output_device->device, event.type, event.code, event.value);
+  }
+
+  smp_store_release(&ring->tail, tail);
+
+  return 1;
+}
+
+/* Events copied from user space at once, keeps the buffer small enough for the
+ * kernel stack */
+#define INPUT_KEYBOARD_WRITE_CHUNK 16
+
 ssize_t write_to_input_keyboard(struct file*       filp,
                                 const char __user* buf,
                                 size_t             count,
                                 loff_t*            f_pos) {
-  unsigned char data[sizeof(struct input_event)];
-  struct input_event* event  = NULL;
-  struct list_entry*  entry  = filp->private_data;
-  ssize_t             retval = 0;
+  struct input_event  events[INPUT_KEYBOARD_WRITE_CHUNK];
+  struct keyboard_entry*  entry   = filp->private_data;
+  size_t              written = 0;
+  size_t              size    = 0;
+  size_t              i       = 0;
+
+  /* A single byte is the doorbell of the ring */
+  if (count == 1) {
+    return drain_ring(&entry->device);
+  }
 
-  if (count != sizeof(struct input_event)) {
-    printk(KERN_ERR "Value size is not equal to buffer block size\n");
+  if (count == 0 || count % sizeof(struct input_event) != 0) {
+    printk(KERN_ERR "Value size is not a multiple of the event size\n");
     return -EFAULT;
   }
 
-  if (raw_copy_from_user(&data, buf, count) != 0) {
-    printk(KERN_ERR "Failed to get data from user\n");
-    retval = -EFAULT;
-    goto out;
+  while (written < count) {
+    size = min(count - written, sizeof(events));
+
+    if (copy_from_user(events, buf + written, size) != 0) {
+      printk(KERN_ERR "Failed to get data from user\n");
+      break;
+    }
+
+    for (i = 0; i < size / sizeof(struct input_event); ++i) {
+      input_event(entry->device.output_device->device,
+                  events[i].type,
+                  events[i].code,
+                  events[i].value);
+    }
+
+    written += size;
+  }
+
+  if (written == 0) {
+    return -EFAULT;
   }
 
-  event = (struct input_event*)data;
+  return written;
+}
 
-  input_event(entry->device.output_device->device,
-              event->type,
-              event->code,
-              event->value);
+long ioctl_input_keyboard(struct file*  filp,
+                          unsigned int  cmd,
+                          unsigned long arg) {
+  struct keyboard_entry* entry = filp->private_data;
 
-  retval = count;
+  switch (cmd) {
+  case KEYBOARD_HOOK_WRITER_SET_REMAP:
+    return attach_remap_filter(entry->device.output_device,
+                               (const struct keyboard_hook_writer_remap __user*)arg);
 
-out:
-  return retval;
+  case KEYBOARD_HOOK_WRITER_CLEAR_REMAP:
+    detach_remap_filter(entry->device.output_device);
+    return 0;
+  }
+
+  return -ENOTTY;
 }
 
 int release_input_keyboard(struct inode* inode, struct file* filp) {
-  struct list_entry* entry = filp->private_data;
+  struct keyboard_entry* entry = filp->private_data;
 
-  release_output_keyboard(entry->device.output_device);
+  detach_remap_filter(entry->device.output_device);
 
-  mutex_unlock(&entry->device.mutex);
+  /* The mappings of the ring hold the file, none is left */
+  vfree(entry->device.ring);
+  entry->device.ring = NULL;
 
-  release_input_keyboard_routine(entry);
+  clear_bit(INPUT_KEYBOARD_IS_OPEN, &entry->device.flags);
+
+  /* The keyboard and this device stay for a restarted reader to reattach */
+  detach_output_keyboard(entry->device.output_device);
   return 0;
 }
 
 struct file_operations input_keyboard_Fops = {
-  .owner   = THIS_MODULE,
-  .open    = open_input_keyboard,
-  .write   = write_to_input_keyboard,
-  .release = release_input_keyboard,
+  .owner          = THIS_MODULE,
+  .open           = open_input_keyboard,
+  .write          = write_to_input_keyboard,
+  .mmap           = mmap_input_keyboard,
+  .unlocked_ioctl = ioctl_input_keyboard,
+  .compat_ioctl   = compat_ptr_ioctl,
+  .release        = release_input_keyboard,
 };
 
+/* Runs once the last reference to the node is gone, an open that looked the
+ * node up holds one */
+static void
+free_input_keyboard(struct device* dev) {
+  struct keyboard_entry* entry = container_of(dev, struct keyboard_entry, device.dev);
+
+  put_output_keyboard(entry->device.output_device);
+  kfree(entry);
+}
+
 int
 create_input_keyboard(unsigned int            major,
-                      unsigned int            minor,
+                      unsigned int            first_minor,
                       struct class*           class,
                       struct output_keyboard* output_device) {
-  char device_name[256];
   int            error = 0;
   dev_t          devno;
-  struct device* device = NULL;
-  struct list_entry* entry = NULL;
+  u32            minor = 0;
+  struct keyboard_entry* entry = NULL;
 
-  entry = (struct list_entry*)kzalloc(sizeof(struct list_entry), GFP_KERNEL);
+  entry = (struct keyboard_entry*)kzalloc(sizeof(struct keyboard_entry), GFP_KERNEL);
 
   if (entry == NULL) {
     printk(KERN_ERR "input_keyboard.c: Not enough memory\n");
@@ -117,6 +249,18 @@ create_input_keyboard(unsigned int            major,
     return error;
   }
 
+  error = xa_alloc(&_keyboards,
+                   &minor,
+                   entry,
+                   XA_LIMIT(first_minor, KEYBOARD_HOOK_WRITER_MINOR_COUNT - 1),
+                   GFP_KERNEL);
+
+  if (error) {
+    printk(KERN_ERR "input_keyboard.c: No free minor left\n");
+    kfree(entry);
+    return error;
+  }
+
   devno = MKDEV(major, minor);
 
   BUG_ON(class == NULL);
@@ -124,68 +268,62 @@ create_input_keyboard(unsigned int            major,
   entry->device.major = major;
   entry->device.class = class;
   entry->device.minor = minor;
-  mutex_init(&entry->device.mutex);
+  entry->device.output_device = output_device;
+
+  /* From here on the entry is freed with the last reference to the node */
+  device_initialize(&entry->device.dev);
+  entry->device.dev.devt    = devno;
+  entry->device.dev.class   = class;
+  entry->device.dev.release = free_input_keyboard;
+  get_output_keyboard(output_device);
 
   cdev_init(&entry->device.cdev, &input_keyboard_Fops);
   entry->device.cdev.owner = THIS_MODULE;
 
-  error = cdev_add(&entry->device.cdev, devno, 1);
+  error = dev_set_name(&entry->device.dev, "%s%d",
+                       KEYBOARD_HOOK_WRITER_INPUT_KEYBOARD_DEVICE_NAME,
+                       output_device->number);
+
+  if (error == 0) {
+    error = cdev_device_add(&entry->device.cdev, &entry->device.dev);
+  }
 
   if (error) {
     printk(KERN_ERR "[target] Error %d while trying to add input_keyboard (minor %d)",
            error,
            minor);
-    kfree(entry);
+    xa_erase(&_keyboards, minor);
+    put_device(&entry->device.dev);
     return error;
   }
 
-  snprintf(device_name, 256, "%s%d",
-           KEYBOARD_HOOK_WRITER_INPUT_KEYBOARD_DEVICE_NAME,
-           output_device->number);
-
-  device = device_create(class, NULL,       /* no parent device */
-                         devno, NULL, /* no additional data */
-                         device_name);
-
-  if (IS_ERR(device)) {
-    error = PTR_ERR(device);
-    printk(
-      KERN_ERR "[target] Error %d while trying to create %s (minor %d)",
-      error,
-      device_name,
-      minor);
-    cdev_del(&entry->device.cdev);
-    kfree(entry);
-    return error;
-  }
-
-  entry->device.output_device = output_device;
-
-  list_add(&entry->list, &_list);
+  output_device->input_keyboard = &entry->device;
 
   return 0;
 }
 
 void
 release_all_input_keyboards(void) {
-  struct list_entry* i;
-  list_for_each_entry(i, &_list, list) {
-    release_input_keyboard_routine(i);
+  struct keyboard_entry* entry;
+  unsigned long          minor;
+
+  /* Erasing the entry iterated over is safe */
+  xa_for_each(&_keyboards, minor, entry) {
+    destroy_input_keyboard(&entry->device);
   }
 }
 
-void release_input_keyboard_routine(struct list_entry* entry) {
+void destroy_input_keyboard(struct input_keyboard* device) {
+  struct keyboard_entry* entry = container_of(device, struct keyboard_entry, device);
+
   if (entry->device.class == NULL) {
     return;
   }
 
-  device_destroy(entry->device.class,
-                 MKDEV(entry->device.major, entry->device.minor));
+  cdev_device_del(&entry->device.cdev, &entry->device.dev);
 
-  cdev_del(&entry->device.cdev);
-
-  list_del(&entry->list);
-  kfree(entry);
+  xa_erase(&_keyboards, entry->device.minor);
+  put_device(&entry->device.dev);
 
   return;
 }
@@ -15,21 +15,33 @@
 
 #include <asm/uaccess.h>
 
+struct keyboard_hook_writer_ring;
+
+#define INPUT_KEYBOARD_IS_OPEN 0
+
 struct input_keyboard {
-  unsigned int            major;
-  unsigned int            minor;
-  struct class*           class;
-  struct mutex            mutex;
-  struct cdev             cdev;
-  struct output_keyboard* output_device;
+  unsigned int                      major;
+  unsigned int                      minor;
+  struct class*                     class;
+  /* INPUT_KEYBOARD_IS_OPEN while a process has the keyboard open */
+  unsigned long                     flags;
+  struct cdev                       cdev;
+  /* Node of the keyboard, the cdev holds it while the keyboard is opened */
+  struct device                     dev;
+  struct output_keyboard*           output_device;
+  /* Shared with the process that opened the keyboard, allocated on open */
+  struct keyboard_hook_writer_ring* ring;
 };
 
 int
 create_input_keyboard(unsigned int            major,
-                      unsigned int            minor,
+                      unsigned int            first_minor,
                       struct class*           class,
                       struct output_keyboard* output_device);
 
+void
+destroy_input_keyboard(struct input_keyboard* device);
+
 void
 release_all_input_keyboards(void);
 
@@ -16,13 +16,14 @@
 
 #include "device_info_buffer.h"
 #include "output_keyboard.h"
+#include "remap_filter.h"
 
 MODULE_AUTHOR("Yuki");
 MODULE_LICENSE("Dual BSD/GPL");
 
 #define KEYBOARD_HOOK_WRITER_MODULE_NAME "keyboard_hook_writer"
 
-static int const _deviceCount = MAX_NUMBER_OF_DEVICES + 1;
+static int const _deviceCount = KEYBOARD_HOOK_WRITER_MINOR_COUNT;
 
 static unsigned int _major = 0;
 static struct class* _class = NULL;
@@ -66,9 +67,26 @@ static int __init cfake_init_module(void) {
     return err;
   }
 
+  err = init_output_keyboards();
+
+  if (err != 0) {
+    cfake_cleanup_module();
+    return err;
+  }
+
   err = create_device_info_buffer(_major, 0, _class);
 
   if (err != 0) {
+    release_all_output_keyboards();
+    cfake_cleanup_module();
+    return err;
+  }
+
+  err = register_remap_filter();
+
+  if (err != 0) {
+    printk(KERN_WARNING "[target] Failed to register the remap filter\n");
+    destroy_device_info_buffer();
     cfake_cleanup_module();
     return err;
   }
@@ -77,6 +95,7 @@ static int __init cfake_init_module(void) {
 }
 
 static void __exit cfake_exit_module(void) {
+  unregister_remap_filter();
   destroy_device_info_buffer();
   cfake_cleanup_module();
   return;
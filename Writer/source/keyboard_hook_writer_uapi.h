@@ -0,0 +1,75 @@
+#ifndef _KEYBOARD_HOOK_WRITER_UAPI_
+#define _KEYBOARD_HOOK_WRITER_UAPI_
+
+/* Interface of the writer module shared with the reader, included from both
+ * the kernel and user space */
+
+#include <linux/input.h>
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define KEYBOARD_HOOK_WRITER_IOCTL_MAGIC 'k'
+
+/* Target of a key whose events are dropped */
+#define KEYBOARD_HOOK_WRITER_REMAP_DROP 0xffff
+
+/* Target code of every source key code */
+struct keyboard_hook_writer_remap {
+  __u16 codes[KEY_CNT];
+};
+
+/* Remaps the events of the physical device the keyboard was created for
+ * (/dev/input/eventN) in the module and injects them directly, the events no
+ * longer reach the other handlers of the device. Setting the table again
+ * replaces it, keys held are released with the code they were pressed with. */
+#define KEYBOARD_HOOK_WRITER_SET_REMAP                                         \
+  _IOW(KEYBOARD_HOOK_WRITER_IOCTL_MAGIC, 1, struct keyboard_hook_writer_remap)
+
+/* Stops remapping in the module, the events reach the device handlers again */
+#define KEYBOARD_HOOK_WRITER_CLEAR_REMAP _IO(KEYBOARD_HOOK_WRITER_IOCTL_MAGIC, 2)
+
+#define KEYBOARD_HOOK_WRITER_DESCRIPTOR_MAGIC 0x4b484453 /* "KHDS" */
+
+#define KEYBOARD_HOOK_WRITER_DESCRIPTOR_VERSION 1
+
+#define KEYBOARD_HOOK_WRITER_NAME_SIZE 80
+
+/* Virtual keyboard to create, written to the device info buffer. Followed by
+ * bitmap_count capability bitmaps. */
+struct keyboard_hook_writer_descriptor {
+  __u32           magic;
+  __u32           version;
+  /* N of the /dev/input/eventN the keyboard stands in for */
+  __u32           number;
+  __u32           bitmap_count;
+  struct input_id id;
+  char            name[KEYBOARD_HOOK_WRITER_NAME_SIZE];
+  char            phys[KEYBOARD_HOOK_WRITER_NAME_SIZE];
+};
+
+/* Header of a capability bitmap, followed by the size bytes EVIOCGBIT(type)
+ * returned for the physical device (type 0 is the bitmap of event types) */
+struct keyboard_hook_writer_bitmap {
+  __u16 type;
+  __u16 size;
+};
+
+/* Events of the ring, a power of two */
+#define KEYBOARD_HOOK_WRITER_RING_SIZE 1024
+
+/* Single producer, single consumer ring of events to inject, mapped with mmap
+ * of the keyboard at offset 0. The reader appends events and advances the
+ * head, a write of a single byte (the doorbell) has the module inject all the
+ * events up to the head before it returns. The counters wrap, the index of an
+ * event is its counter modulo the size. */
+struct keyboard_hook_writer_ring {
+  /* Written by the reader only */
+  __u32              head;
+  __u8               head_padding[60];
+  /* Written by the module only */
+  __u32              tail;
+  __u8               tail_padding[60];
+  struct input_event events[KEYBOARD_HOOK_WRITER_RING_SIZE];
+};
+
+#endif
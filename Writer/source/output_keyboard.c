@@ -10,131 +10,261 @@
 #include <linux/sched.h>  // for task_struct
 #include <linux/time.h>
 #include <linux/timer.h>
+#include <linux/xarray.h>
 
 #include "device_info_buffer.h"
 #include "input_keyboard.h"
+#include "keyboard_hook_writer_uapi.h"
 
-struct list_entry {
-  struct list_head       list;
+struct keyboard_entry {
   struct output_keyboard device;
 };
 
-static LIST_HEAD(_list);
-
-struct list_entry*
-find_list_entry(unsigned int device_number) {
-  struct list_entry* i;
-
-  list_for_each_entry(i, &_list, list) {
-    if (i->device.number == device_number) {
-      return i;
-    }
+/* Keyboards by the number of their physical device. The xarray has its own
+ * lock and lookups run under RCU, devices register outside of it. */
+static DEFINE_XARRAY(_keyboards);
+
+/* Guards whether keyboards are attached, and the release of those that are
+ * not */
+static DEFINE_MUTEX(_attach_mutex);
+
+static struct workqueue_struct* _release_workqueue = NULL;
+
+static unsigned int grace_period_ms = 5000;
+module_param(grace_period_ms, uint, 0644);
+MODULE_PARM_DESC(grace_period_ms,
+                 "Milliseconds a keyboard outlives the reader that closed it, for a "
+                 "restarted reader to reattach");
+
+/* Capability bitmap of the device, the bitmap of an event type is copied to */
+static unsigned long*
+find_code_bits(struct input_dev* dev, unsigned int type, size_t* size) {
+  switch (type) {
+  case 0:
+    *size = sizeof(dev->evbit);
+    return dev->evbit;
+
+  case EV_KEY:
+    *size = sizeof(dev->keybit);
+    return dev->keybit;
+
+  case EV_REL:
+    *size = sizeof(dev->relbit);
+    return dev->relbit;
+
+  case EV_MSC:
+    *size = sizeof(dev->mscbit);
+    return dev->mscbit;
+
+  case EV_LED:
+    *size = sizeof(dev->ledbit);
+    return dev->ledbit;
+
+  case EV_SND:
+    *size = sizeof(dev->sndbit);
+    return dev->sndbit;
+
+  case EV_SW:
+    *size = sizeof(dev->swbit);
+    return dev->swbit;
   }
 
   return NULL;
 }
 
 int
-get_int_from_data(unsigned char* data, unsigned int* index) {
-  unsigned int count = sizeof(int) / sizeof(unsigned char);
+parse_device_info(struct keyboard_entry* entry, const struct device_info* info) {
+  const struct keyboard_hook_writer_descriptor* descriptor = NULL;
+  struct keyboard_hook_writer_bitmap            bitmap;
+  struct input_dev*                             dev        = entry->device.device;
+  unsigned long                                 end        = info->size;
+  unsigned long                                 index      = sizeof(*descriptor);
+  unsigned long*                                bits       = NULL;
+  size_t                                        size       = 0;
+  __u32                                         i          = 0;
+
+  descriptor = (const struct keyboard_hook_writer_descriptor*)info->data;
+
+  if (end < sizeof(*descriptor)
+      || descriptor->magic != KEYBOARD_HOOK_WRITER_DESCRIPTOR_MAGIC
+      || descriptor->version != KEYBOARD_HOOK_WRITER_DESCRIPTOR_VERSION) {
+    printk(KERN_ERR "output_keyboard.c: Unsupported device descriptor\n");
+    return -EINVAL;
+  }
 
-  int* result = (int*)&data[*index];
+  /* The descriptor is freed once the device is created */
+  entry->device.name = kstrndup(descriptor->name, KEYBOARD_HOOK_WRITER_NAME_SIZE, GFP_KERNEL);
+  entry->device.phys = kstrndup(descriptor->phys, KEYBOARD_HOOK_WRITER_NAME_SIZE, GFP_KERNEL);
 
-  *index += count;
-  return *result;
-}
+  if (entry->device.name == NULL || entry->device.phys == NULL) {
+    printk(KERN_ERR "output_keyboard.c: Not enough memory\n");
+    return -ENOMEM;
+  }
+
+  entry->device.number = descriptor->number;
+  dev->name            = entry->device.name;
+  dev->phys            = entry->device.phys;
+  dev->id              = descriptor->id;
+
+  for (i = 0; i < descriptor->bitmap_count; ++i) {
+    if (end - index < sizeof(bitmap)) {
+      break;
+    }
+
+    memcpy(&bitmap, &info->data[index], sizeof(bitmap));
+    index += sizeof(bitmap);
+
+    if (end - index < bitmap.size) {
+      break;
+    }
 
-unsigned int
-get_unsigned_int_from_data(unsigned char* data, unsigned int* index) {
-  unsigned int count = sizeof(unsigned int) / sizeof(unsigned char);
+    /* Codes beyond the bitmaps of this kernel are not supported anyway */
+    bits = find_code_bits(dev, bitmap.type, &size);
 
-  unsigned int* result = (unsigned int*)&data[*index];
+    if (bits != NULL) {
+      memcpy(bits, &info->data[index], min_t(size_t, size, bitmap.size));
+    }
+
+    index += bitmap.size;
+  }
 
-  *index += count;
-  return *result;
+  if (i != descriptor->bitmap_count) {
+    printk(KERN_ERR "output_keyboard.c: Truncated device descriptor\n");
+    return -EINVAL;
+  }
+
+  return 0;
 }
 
-void parse_info(struct device_info_buffer* infoBuffer,
-                unsigned int*            index,
-                struct list_entry*       entry) {
-  unsigned int size = get_unsigned_int_from_data(infoBuffer->data, index);
-  entry->device.number = size;
-  size = get_unsigned_int_from_data(infoBuffer->data, index);
-  entry->device.device->name = &infoBuffer->data[*index];
-  *index += size;
-
-  size = get_unsigned_int_from_data(infoBuffer->data, index);
-  entry->device.device->phys = &infoBuffer->data[*index];
-  *index += size;
-
-  entry->device.device->id.bustype = get_int_from_data(infoBuffer->data, index);
-  entry->device.device->id.vendor  = get_int_from_data(infoBuffer->data, index);
-  entry->device.device->id.product = get_int_from_data(infoBuffer->data, index);
-  entry->device.device->id.version = get_int_from_data(infoBuffer->data, index);
+/* Frees a device that is not registered (anymore) */
+static void
+free_output_keyboard(struct keyboard_entry* entry) {
+  if (entry->device.device != NULL) {
+    input_free_device(entry->device.device);
+  }
+
+  kfree(entry->device.descriptor);
+  kfree(entry->device.name);
+  kfree(entry->device.phys);
+  kfree(entry);
 }
 
-void parse_code_bits(struct device_info_buffer* infoBuffer,
-                     unsigned int*            index,
-                     struct list_entry*        entry) {
-  unsigned int type = get_unsigned_int_from_data(
-    infoBuffer->data, index);
-  unsigned int size = get_unsigned_int_from_data(
-    infoBuffer->data, index);
-  unsigned int startIndex = 0;
+static void
+release_output_keyboard(struct kref* kref) {
+  struct output_keyboard* device = container_of(kref, struct output_keyboard, kref);
 
-  entry->device.device->evbit[0] |= BIT_MASK(type);
+  free_output_keyboard(container_of(device, struct keyboard_entry, device));
+}
 
-  startIndex = *index;
+void
+get_output_keyboard(struct output_keyboard* device) {
+  kref_get(&device->kref);
+}
 
-  for (; (*index - startIndex) < size;) {
-    unsigned int code = get_unsigned_int_from_data(infoBuffer->data, index);
+void
+put_output_keyboard(struct output_keyboard* device) {
+  kref_put(&device->kref, release_output_keyboard);
+}
 
-    if (type == EV_KEY) {
-      entry->device.device->keybit[BIT_WORD(code)] |= BIT_MASK(code);
-    } else if (type == EV_LED) {
-      entry->device.device->ledbit[BIT_WORD(code)] |= BIT_MASK(code);
-    }
+/* Removes the keyboard from the registry, the keyboard is released once, by
+ * whoever removed it */
+static bool
+take_output_keyboard(struct keyboard_entry* entry) {
+  return xa_cmpxchg(&_keyboards, entry->device.number, entry, NULL, GFP_KERNEL) == entry;
+}
+
+static void
+destroy_output_keyboard(struct keyboard_entry* entry) {
+  if (entry->device.input_keyboard != NULL) {
+    destroy_input_keyboard(entry->device.input_keyboard);
   }
+
+  input_unregister_device(entry->device.device);
+  entry->device.device = NULL;
+
+  /* An open of the node that is still running holds the keyboard */
+  put_output_keyboard(&entry->device);
 }
 
-void
-parse_device_info(struct list_entry* entry) {
-  struct device_info_buffer* infoBuffer = get_device_info_buffer();
-  unsigned int             index      = 0;
-  unsigned int             size       = 0;
-  unsigned int             startIndex = 0;
+static void
+release_orphaned_output_keyboard(struct work_struct* work) {
+  struct output_keyboard* device
+    = container_of(to_delayed_work(work), struct output_keyboard, release_work);
+  struct keyboard_entry* entry = container_of(device, struct keyboard_entry, device);
+  bool                   taken = false;
 
-  parse_info(infoBuffer, &index, entry);
+  mutex_lock(&_attach_mutex);
 
-  size = get_unsigned_int_from_data(infoBuffer->data, &index);
+  if (!device->is_attached) {
+    taken = take_output_keyboard(entry);
+  }
 
-  startIndex = index;
+  mutex_unlock(&_attach_mutex);
 
-  for (; (index - startIndex) < size;)
-    parse_code_bits(infoBuffer, &index, entry);
+  if (taken) {
+    printk(KERN_INFO "output_keyboard.c: Released device %d\n", device->number);
+    destroy_output_keyboard(entry);
+  }
 }
 
-int create_output_keyboard(unsigned int  major,
-                           unsigned int  minor,
-                           struct class* class) {
-  int               error      = 0;
-  struct list_entry* find_entry = NULL;
-  struct list_entry* entry      = NULL;
-  int               size       = 0;
+/* Keeps an orphaned keyboard of the same descriptor for the reader to
+ * reattach to, replaces one of another descriptor. Returns 1 if the keyboard
+ * is kept, 0 if the number is free. */
+static int
+reclaim_output_keyboard(int number, const struct device_info* info) {
+  struct keyboard_entry* entry  = NULL;
+  bool                   taken  = false;
+  int                    result = 0;
+
+  mutex_lock(&_attach_mutex);
+
+  entry = xa_load(&_keyboards, number);
+
+  if (entry == NULL) {
+    result = 0;
+  } else if (entry->device.is_attached) {
+    result = -EEXIST;
+  } else if (entry->device.descriptor_size == info->size
+             && memcmp(entry->device.descriptor, info->data, info->size) == 0) {
+    /* The grace period starts over, the reader opens the keyboard next */
+    mod_delayed_work(_release_workqueue,
+                     &entry->device.release_work,
+                     msecs_to_jiffies(grace_period_ms));
+    result = 1;
+  } else {
+    taken = take_output_keyboard(entry);
+  }
+
+  mutex_unlock(&_attach_mutex);
 
-  list_for_each_entry(find_entry, &_list, list) {
-    ++size;
+  if (taken) {
+    cancel_delayed_work_sync(&entry->device.release_work);
+    destroy_output_keyboard(entry);
   }
 
-  if (size == MAX_NUMBER_OF_DEVICES) {
-    printk(KERN_ERR "output_keyboard.c: Too many devices allocated already\n");
-    return -EFAULT;
+  return result;
+}
+
+int
+init_output_keyboards(void) {
+  _release_workqueue = alloc_workqueue("keyboard_hook_writer", 0, 0);
+
+  if (_release_workqueue == NULL) {
+    return -ENOMEM;
   }
 
-  find_entry = NULL;
+  return 0;
+}
+
+int create_output_keyboard(unsigned int              major,
+                           unsigned int              minor,
+                           struct class*             class,
+                           const struct device_info* info) {
+  int                    error = 0;
+  struct keyboard_entry* entry = NULL;
 
-  entry = (struct list_entry*)kzalloc(
-    sizeof(struct list_entry),
+  entry = (struct keyboard_entry*)kzalloc(
+    sizeof(struct keyboard_entry),
     GFP_KERNEL);
 
   if (!entry) {
@@ -147,21 +277,52 @@ int create_output_keyboard(unsigned int  major,
 
   if (!entry->device.device) {
     printk(KERN_ERR "output_keyboard.c: Not enough memory\n");
-    kfree(entry);
     error = -ENOMEM;
-    return error;
+    goto out_free;
   }
 
   printk(KERN_INFO "output_keyboard.c: Allocated new device\n");
 
-  parse_device_info(entry);
-  find_entry = find_list_entry(entry->device.number);
+  error = parse_device_info(entry, info);
+
+  if (error != 0) {
+    goto out_free;
+  }
+
+  error = reclaim_output_keyboard(entry->device.number, info);
 
-  if (find_entry != 0) {
+  if (error != 0) {
+    if (error > 0) {
+      printk(KERN_INFO "output_keyboard.c: Reattaching device %d\n", entry->device.number);
+      error = 0;
+    }
+
+    goto out_free;
+  }
+
+  entry->device.descriptor = kmemdup(info->data, info->size, GFP_KERNEL);
+
+  if (entry->device.descriptor == NULL) {
+    printk(KERN_ERR "output_keyboard.c: Not enough memory\n");
+    error = -ENOMEM;
+    goto out_free;
+  }
+
+  entry->device.descriptor_size = info->size;
+  kref_init(&entry->device.kref);
+  INIT_DELAYED_WORK(&entry->device.release_work, release_orphaned_output_keyboard);
+
+  /* Claims the number, the registration runs unlocked so that devices of
+   * other numbers register in parallel */
+  error = xa_insert(&_keyboards, entry->device.number, entry, GFP_KERNEL);
+
+  if (error == -EBUSY) {
     printk(KERN_ERR "output_keyboard.c: Device already exists\n");
-    input_free_device(entry->device.device);
-    kfree(entry);
-    return -EFAULT;
+    error = -EEXIST;
+  }
+
+  if (error != 0) {
+    goto out_free;
   }
 
   for (int i = 0; i < 3; ++i) {
@@ -172,51 +333,112 @@ int create_output_keyboard(unsigned int  major,
 
   if (error) {
     printk(KERN_ERR "output_keyboard.c: Failed to register device\n");
-    input_free_device(entry->device.device);
-    kfree(entry);
-    return error;
+    goto out_remove;
   }
 
   error = create_input_keyboard(major,
-                              minor + size,
+                              minor,
                               class,
                               &entry->device);
 
-  printk(KERN_INFO "output_keyboard.c: Created device %u %s\n", entry->device.number, entry->device.device->name);
-
   if (error != 0) {
     printk(KERN_ERR "output_keyboard.c: Failed to create_input_keyboard\n");
-    input_unregister_device(entry->device.device);
-    input_free_device(entry->device.device);
-    kfree(entry);
-    return error;
+    goto out_unregister;
+  }
+
+  printk(KERN_INFO "output_keyboard.c: Created device %u %s\n", entry->device.number, entry->device.name);
+
+  /* A keyboard the reader never opens is released like an orphaned one */
+  mutex_lock(&_attach_mutex);
+
+  if (!entry->device.is_attached) {
+    mod_delayed_work(_release_workqueue,
+                     &entry->device.release_work,
+                     msecs_to_jiffies(grace_period_ms));
   }
 
-  list_add(&entry->list, &_list);
+  mutex_unlock(&_attach_mutex);
 
   return 0;
+
+out_unregister:
+  /* Unregistering drops the last reference, the device is freed with it */
+  input_unregister_device(entry->device.device);
+  entry->device.device = NULL;
+
+out_remove:
+  xa_erase(&_keyboards, entry->device.number);
+
+out_free:
+  free_output_keyboard(entry);
+
+  return error;
+}
+
+int
+attach_output_keyboard(struct output_keyboard* device) {
+  struct keyboard_entry* entry = container_of(device, struct keyboard_entry, device);
+  int                    error = 0;
+
+  mutex_lock(&_attach_mutex);
+
+  if (xa_load(&_keyboards, device->number) != entry) {
+    /* Released already, its device is about to go */
+    error = -ENODEV;
+  } else if (device->is_attached) {
+    error = -EBUSY;
+  } else {
+    device->is_attached = true;
+    cancel_delayed_work(&device->release_work);
+  }
+
+  mutex_unlock(&_attach_mutex);
+
+  return error;
 }
 
 void
-release_all_output_keyboards(void) {
-  struct list_entry* i;
-  list_for_each_entry(i, &_list, list) {
-    release_output_keyboard(&i->device);
+detach_output_keyboard(struct output_keyboard* device) {
+  unsigned int code = 0;
+
+  /* Nobody else knows of the keys the reader left pressed */
+  for_each_set_bit(code, device->device->key, KEY_CNT) {
+    input_event(device->device, EV_KEY, code, 0);
   }
-  release_all_input_keyboards();
+
+  input_sync(device->device);
+
+  mutex_lock(&_attach_mutex);
+
+  device->is_attached = false;
+  mod_delayed_work(_release_workqueue,
+                   &device->release_work,
+                   msecs_to_jiffies(grace_period_ms));
+
+  mutex_unlock(&_attach_mutex);
 }
 
 void
-release_output_keyboard(struct output_keyboard* device) {
-  struct list_entry* entry = find_list_entry(device->number);
+release_all_output_keyboards(void) {
+  struct keyboard_entry* entry;
+  unsigned long          number;
 
-  if (entry == 0) {
+  if (_release_workqueue == NULL) {
     return;
   }
 
-  input_unregister_device(entry->device.device);
-  input_free_device(entry->device.device);
+  /* Nothing is attached while the module unloads, all the keyboards are
+   * released right away */
+  mutex_lock(&_attach_mutex);
 
-  list_del(&entry->list);
-  kfree(entry);
+  xa_for_each(&_keyboards, number, entry) {
+    mod_delayed_work(_release_workqueue, &entry->device.release_work, 0);
+  }
+
+  mutex_unlock(&_attach_mutex);
+
+  destroy_workqueue(_release_workqueue);
+  _release_workqueue = NULL;
+
+  release_all_input_keyboards();
 }
@@ -7,25 +7,67 @@
 #include <linux/errno.h>
 #include <linux/fs.h>
 #include <linux/kernel.h>
+#include <linux/kref.h>
 #include <linux/mutex.h>
 #include <linux/slab.h>
 #include <linux/version.h>
+#include <linux/workqueue.h>
 
-#define MAX_NUMBER_OF_DEVICES 10
+/* Minors of the module, the device info buffer has the first one and the
+ * keyboards any of the rest */
+#define KEYBOARD_HOOK_WRITER_MINOR_COUNT (MINORMASK + 1)
+
+struct device_info;
+struct input_keyboard;
+struct remap_filter;
 
 struct output_keyboard {
-  int               number;
-  struct input_dev* device;
+  int                    number;
+  struct input_dev*      device;
+  /* Owned by the keyboard, the device only points to them */
+  char*                  name;
+  char*                  phys;
+  /* Set while the module remaps the physical device itself */
+  struct remap_filter*   remap_filter;
+  /* Character device the events are injected through */
+  struct input_keyboard* input_keyboard;
+  /* The keyboard is kept for a reader presenting the same descriptor */
+  unsigned char*         descriptor;
+  unsigned long          descriptor_size;
+  /* Set while a reader has the keyboard open, without one the keyboard is
+   * released after the grace period */
+  bool                   is_attached;
+  struct delayed_work    release_work;
+  /* Held by the registry and by the node of the input keyboard */
+  struct kref            kref;
 };
 
 int
-create_output_keyboard(unsigned int  major,
-                       unsigned int  minor,
-                       struct class* class);
+init_output_keyboards(void);
+
+int
+create_output_keyboard(unsigned int              major,
+                       unsigned int              minor,
+                       struct class*             class,
+                       const struct device_info* info);
 
 void
 release_all_output_keyboards(void);
 
 void
-release_output_keyboard(struct output_keyboard* device);
+get_output_keyboard(struct output_keyboard* device);
+
+/* Frees the keyboard with the last reference */
+void
+put_output_keyboard(struct output_keyboard* device);
+
+/* Claims the keyboard for the reader that opened it, fails once the keyboard
+ * is released */
+int
+attach_output_keyboard(struct output_keyboard* device);
+
+/* Releases the keys held and the keyboard itself once the grace period is
+ * over, unless a reader attaches again */
+void
+detach_output_keyboard(struct output_keyboard* device);
 #endif
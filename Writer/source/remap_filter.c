@@ -0,0 +1,338 @@
+#include "remap_filter.h"
+
+#include <linux/input.h>
+#include <linux/irq_work.h>
+#include <linux/kfifo.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+#include <linux/uaccess.h>
+
+#define KEYBOARD_HOOK_WRITER_REMAP_FILTER_NAME "keyboard_hook_writer_remap"
+
+/* Events remapped and not injected yet, a power of two */
+#define REMAP_FILTER_QUEUE_SIZE 256
+
+struct remap_filter;
+
+struct remap_handle {
+  struct list_head     list;
+  struct input_handle  handle;
+  /* Set and cleared under the event lock of the device, the filter runs
+   * under it */
+  struct remap_filter* filter;
+};
+
+struct remap_filter {
+  struct remap_handle*              handle;
+  struct output_keyboard*           output_device;
+  struct keyboard_hook_writer_remap remap;
+  /* Code every held key was pressed with, KEY_RESERVED if not held */
+  __u16                             held[KEY_CNT];
+  unsigned long                     dropped;
+  /* The filter runs under the event lock of the physical device, the events
+   * are injected from an irq_work so that the lock of the keyboard is never
+   * taken inside it */
+  struct irq_work                   work;
+  /* The work queued again from another CPU may run while it still runs, the
+   * fifo has a single consumer and the events are injected in order */
+  spinlock_t                        inject_lock;
+  DECLARE_KFIFO(events, struct input_value, REMAP_FILTER_QUEUE_SIZE);
+};
+
+/* Guards the handles and the filters attached to them */
+static DEFINE_MUTEX(_mutex);
+
+static LIST_HEAD(_handles);
+
+static void
+inject_remapped_events(struct irq_work* work) {
+  struct remap_filter* filter = container_of(work, struct remap_filter, work);
+  struct input_value   event;
+  unsigned long        flags;
+
+  spin_lock_irqsave(&filter->inject_lock, flags);
+
+  while (kfifo_get(&filter->events, &event)) {
+    input_event(filter->output_device->device, event.type, event.code, event.value);
+  }
+
+  spin_unlock_irqrestore(&filter->inject_lock, flags);
+}
+
+static bool
+filter_event(struct input_handle* handle,
+             unsigned int         type,
+             unsigned int         code,
+             int                  value) {
+  struct remap_handle* remap_handle = container_of(handle, struct remap_handle, handle);
+  struct remap_filter* filter       = remap_handle->filter;
+  struct input_value   event        = { .type = type, .code = code, .value = value };
+
+  if (filter == NULL) {
+    return false;
+  }
+
+  if (type == EV_KEY && code < KEY_CNT) {
+    /* Repeats and the release follow the press, whatever the table is now */
+    if (value == 1 || filter->held[code] == KEY_RESERVED) {
+      event.code = filter->remap.codes[code];
+    } else {
+      event.code = filter->held[code];
+    }
+
+    filter->held[code] = value == 0 ? KEY_RESERVED : event.code;
+
+    if (event.code == KEYBOARD_HOOK_WRITER_REMAP_DROP) {
+      return true;
+    }
+  }
+
+  if (!kfifo_put(&filter->events, event)) {
+    ++filter->dropped;
+  }
+
+  irq_work_queue(&filter->work);
+
+  return true;
+}
+
+/* Handle of the device of /dev/input/eventN, found by the name of its evdev
+ * handle */
+static struct remap_handle*
+find_remap_handle(int number) {
+  char                 name[32];
+  struct remap_handle* remap_handle = NULL;
+  struct input_handle* handle       = NULL;
+  bool                 found        = false;
+
+  snprintf(name, sizeof(name), "event%d", number);
+
+  list_for_each_entry(remap_handle, &_handles, list) {
+    struct input_dev* dev = remap_handle->handle.dev;
+
+    mutex_lock(&dev->mutex);
+
+    list_for_each_entry(handle, &dev->h_list, d_node) {
+      if (handle->name != NULL && strcmp(handle->name, name) == 0) {
+        found = true;
+        break;
+      }
+    }
+
+    mutex_unlock(&dev->mutex);
+
+    if (found) {
+      return remap_handle;
+    }
+  }
+
+  return NULL;
+}
+
+static void
+detach_filter(struct remap_filter* filter) {
+  struct input_dev* dev    = filter->handle->handle.dev;
+  struct input_dev* output = filter->output_device->device;
+  unsigned int      i      = 0;
+
+  spin_lock_irq(&dev->event_lock);
+  filter->handle->filter = NULL;
+  spin_unlock_irq(&dev->event_lock);
+
+  input_close_device(&filter->handle->handle);
+
+  irq_work_sync(&filter->work);
+  inject_remapped_events(&filter->work);
+
+  /* Keys held are released, nobody else knows of them */
+  for (i = 0; i < KEY_CNT; ++i) {
+    if (filter->held[i] != KEY_RESERVED
+        && filter->held[i] != KEYBOARD_HOOK_WRITER_REMAP_DROP) {
+      input_event(output, EV_KEY, filter->held[i], 0);
+    }
+  }
+
+  input_sync(output);
+
+  if (filter->dropped != 0) {
+    printk(KERN_WARNING "remap_filter.c: Dropped %lu events of device %d\n",
+           filter->dropped,
+           filter->output_device->number);
+  }
+
+  filter->output_device->remap_filter = NULL;
+
+  kfree(filter);
+}
+
+int
+attach_remap_filter(struct output_keyboard*                          output_device,
+                    const struct keyboard_hook_writer_remap __user* remap) {
+  struct remap_filter* filter       = NULL;
+  struct remap_handle* remap_handle = NULL;
+  struct input_dev*    dev          = NULL;
+  unsigned int         i            = 0;
+  int                  error        = 0;
+
+  filter = (struct remap_filter*)kzalloc(sizeof(struct remap_filter), GFP_KERNEL);
+
+  if (filter == NULL) {
+    printk(KERN_ERR "remap_filter.c: Not enough memory\n");
+    return -ENOMEM;
+  }
+
+  if (copy_from_user(&filter->remap, remap, sizeof(filter->remap)) != 0) {
+    error = -EFAULT;
+    goto out_free;
+  }
+
+  for (i = 0; i < KEY_CNT; ++i) {
+    if (filter->remap.codes[i] >= KEY_CNT
+        && filter->remap.codes[i] != KEYBOARD_HOOK_WRITER_REMAP_DROP) {
+      error = -EINVAL;
+      goto out_free;
+    }
+  }
+
+  mutex_lock(&_mutex);
+
+  /* Only the table is replaced, the keys held keep their codes */
+  if (output_device->remap_filter != NULL) {
+    dev = output_device->remap_filter->handle->handle.dev;
+
+    spin_lock_irq(&dev->event_lock);
+    memcpy(&output_device->remap_filter->remap, &filter->remap, sizeof(filter->remap));
+    spin_unlock_irq(&dev->event_lock);
+
+    goto out_unlock;
+  }
+
+  remap_handle = find_remap_handle(output_device->number);
+
+  if (remap_handle == NULL) {
+    printk(KERN_ERR "remap_filter.c: No input device event%d\n", output_device->number);
+    error = -ENODEV;
+    goto out_unlock;
+  }
+
+  filter->handle        = remap_handle;
+  filter->output_device = output_device;
+  INIT_KFIFO(filter->events);
+  spin_lock_init(&filter->inject_lock);
+  init_irq_work(&filter->work, inject_remapped_events);
+
+  error = input_open_device(&remap_handle->handle);
+
+  if (error != 0) {
+    printk(KERN_ERR "remap_filter.c: Failed to open input device event%d\n",
+           output_device->number);
+    goto out_unlock;
+  }
+
+  dev = remap_handle->handle.dev;
+
+  spin_lock_irq(&dev->event_lock);
+  remap_handle->filter = filter;
+  spin_unlock_irq(&dev->event_lock);
+
+  output_device->remap_filter = filter;
+  filter                      = NULL;
+
+out_unlock:
+  mutex_unlock(&_mutex);
+
+out_free:
+  kfree(filter);
+
+  return error;
+}
+
+void
+detach_remap_filter(struct output_keyboard* output_device) {
+  mutex_lock(&_mutex);
+
+  if (output_device->remap_filter != NULL) {
+    detach_filter(output_device->remap_filter);
+  }
+
+  mutex_unlock(&_mutex);
+}
+
+static int
+connect_remap_filter(struct input_handler*         handler,
+                     struct input_dev*             dev,
+                     const struct input_device_id* id) {
+  struct remap_handle* remap_handle = NULL;
+  int                  error        = 0;
+
+  remap_handle = (struct remap_handle*)kzalloc(sizeof(struct remap_handle), GFP_KERNEL);
+
+  if (remap_handle == NULL) {
+    return -ENOMEM;
+  }
+
+  remap_handle->handle.dev     = dev;
+  remap_handle->handle.handler = handler;
+  remap_handle->handle.name    = KEYBOARD_HOOK_WRITER_REMAP_FILTER_NAME;
+
+  /* The device is opened only once a table is attached */
+  error = input_register_handle(&remap_handle->handle);
+
+  if (error != 0) {
+    kfree(remap_handle);
+    return error;
+  }
+
+  mutex_lock(&_mutex);
+  list_add(&remap_handle->list, &_handles);
+  mutex_unlock(&_mutex);
+
+  return 0;
+}
+
+static void
+disconnect_remap_filter(struct input_handle* handle) {
+  struct remap_handle* remap_handle = container_of(handle, struct remap_handle, handle);
+
+  mutex_lock(&_mutex);
+
+  if (remap_handle->filter != NULL) {
+    detach_filter(remap_handle->filter);
+  }
+
+  list_del(&remap_handle->list);
+
+  mutex_unlock(&_mutex);
+
+  input_unregister_handle(handle);
+  kfree(remap_handle);
+}
+
+static const struct input_device_id remap_filter_ids[] = {
+  {
+    .flags = INPUT_DEVICE_ID_MATCH_EVBIT,
+    .evbit = { BIT_MASK(EV_KEY) },
+  },
+  {},
+};
+
+static struct input_handler remap_filter_handler = {
+  .filter     = filter_event,
+  .connect    = connect_remap_filter,
+  .disconnect = disconnect_remap_filter,
+  .name       = KEYBOARD_HOOK_WRITER_REMAP_FILTER_NAME,
+  .id_table   = remap_filter_ids,
+};
+
+int
+register_remap_filter(void) {
+  return input_register_handler(&remap_filter_handler);
+}
+
+void
+unregister_remap_filter(void) {
+  input_unregister_handler(&remap_filter_handler);
+}
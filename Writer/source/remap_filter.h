@@ -0,0 +1,22 @@
+#ifndef _KEYBOARD_HOOK_WRITER_REMAP_FILTER_
+#define _KEYBOARD_HOOK_WRITER_REMAP_FILTER_
+
+#include "keyboard_hook_writer_uapi.h"
+#include "output_keyboard.h"
+
+int
+register_remap_filter(void);
+
+void
+unregister_remap_filter(void);
+
+/* Remaps the events of the physical device of the keyboard in the module and
+ * injects them into the keyboard, replaces the table if already remapping */
+int
+attach_remap_filter(struct output_keyboard*                          output_device,
+                    const struct keyboard_hook_writer_remap __user* remap);
+
+void
+detach_remap_filter(struct output_keyboard* output_device);
+
+#endif
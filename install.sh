@@ -22,6 +22,7 @@ sudo depmod
 cd "$SCRIPT_DIR"
 
 sudo cp keyboard-hook-service.sh /etc
+sudo cp -n keyboard-hook.conf /etc
 sudo cp keyboard-hook.service /etc/systemd/system
 sudo systemctl enable --now keyboard-hook
-sudo pkill KeyboardHook; sudo rmmod keyboard_hook_writer; sleep 3; sudo modprobe keyboard_hook_writer; sleep 3; sudo /etc/keyboard-hook-service.sh; sleep 1; xset r rate 200 40
+sudo pkill KeyboardHook; sudo rmmod keyboard_hook_writer; sleep 3; sudo modprobe keyboard_hook_writer; sleep 3; sudo systemctl restart keyboard-hook; sleep 1; xset r rate 200 40
@@ -1,11 +1,10 @@
 #! /usr/bin/env bash
 
-sleep 3
+# Reloading starts a new daemon that takes the keyboards over from the running
+# one, the reload is done as soon as it started
+if [ "$1" = "--takeover" ]; then
+  KeyboardHookReader --takeover &
+  exit 0
+fi
 
-device_ids=$(KeyboardHookReader | grep -i "keyboard" | cut -d' ' -f2 | perl -pe 's/.*?([0-9]+)$/\1/')
-
-for i in $device_ids; do
-    echo "/dev/input/event$i"
-    KeyboardHookReader -i $i &
-    sleep 2
-done
+exec KeyboardHookReader --daemon